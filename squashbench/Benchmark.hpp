@@ -0,0 +1,171 @@
+/**
+ * @file Benchmark.hpp
+ * @author Eliot Fondere
+ * @brief Minimal timing harness for the squashlib microbenchmarks
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_BENCHMARK_HPP
+#define INCLUDE_SQH_BENCHMARK_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string_view>
+
+#include <squashlib/trace/PerfCounters.hpp>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace sqh::bench
+{
+
+// prevents the compiler from discarding a computed value
+template<typename T>
+inline void do_not_optimize(const T& value)
+{
+#if defined(_MSC_VER)
+	const volatile T* sink = &value;
+	(void)sink;
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+// runs function() iterations times per repetition and returns the best time per call in nanoseconds
+template<typename F>
+double measure(F&& function, size_t iterations, size_t repetitions = 7)
+{
+	double best = 0.0;
+
+	for (size_t r = 0; r < repetitions; r++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++)
+		{
+			function();
+		}
+		auto end = std::chrono::steady_clock::now();
+
+		double ns = std::chrono::duration<double, std::nano>(end - start).count() / static_cast<double>(iterations);
+		best = (r == 0) ? ns : std::min(best, ns);
+	}
+
+	return best;
+}
+
+// time stamp counter, 0 where there is none. It counts at a constant reference frequency, which may differ from the
+// actual core clock when the frequency scales
+inline uint64_t read_cycles()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// per item statistics over all samples
+struct Distribution
+{
+	double min_ns;
+	double median_ns;
+	double p99_ns;
+	double cycles;
+
+	// from one extra run, when hardware counters are given
+	bool counted = false;
+	double ipc = 0.0;
+	double cache_misses = 0.0;
+	double branch_misses = 0.0;
+};
+
+// runs function(), which processes items elements, warmup times and then samples times. With counters, one more run
+// is counted outside of the timed samples
+template<typename F>
+Distribution sample(F&& function, size_t items, size_t samples = 51, size_t warmup = 5,
+                    trace::PerfCounters* counters = nullptr)
+{
+	for (size_t w = 0; w < warmup; w++)
+	{
+		function();
+	}
+
+	std::vector<double> times(samples);
+	std::vector<double> cycles(samples);
+
+	for (size_t s = 0; s < samples; s++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		uint64_t start_cycles = read_cycles();
+
+		function();
+
+		uint64_t end_cycles = read_cycles();
+		auto end = std::chrono::steady_clock::now();
+
+		times[s] = std::chrono::duration<double, std::nano>(end - start).count() / static_cast<double>(items);
+		cycles[s] = static_cast<double>(end_cycles - start_cycles) / static_cast<double>(items);
+	}
+
+	std::sort(times.begin(), times.end());
+	std::sort(cycles.begin(), cycles.end());
+
+	size_t p99 = std::min(samples - 1, (samples * 99 + 99) / 100 - 1);
+	Distribution distribution{times.front(), times[samples / 2], times[p99], cycles[samples / 2]};
+
+	if (counters != nullptr)
+	{
+		counters->start();
+		function();
+		trace::CounterValues values = counters->stop();
+
+		distribution.counted = true;
+		distribution.ipc = values.ipc();
+		distribution.cache_misses = static_cast<double>(values.cacheMisses) / static_cast<double>(items);
+		distribution.branch_misses = static_cast<double>(values.branchMisses) / static_cast<double>(items);
+	}
+
+	return distribution;
+}
+
+inline void report(std::string_view name, const Distribution& distribution)
+{
+	std::cout << std::left << std::setw(40) << name << std::right << std::fixed << std::setprecision(2)
+	          << std::setw(10) << distribution.min_ns
+	          << std::setw(10) << distribution.median_ns
+	          << std::setw(10) << distribution.p99_ns
+	          << std::setw(10) << std::setprecision(1) << distribution.cycles;
+
+	if (distribution.counted)
+	{
+		std::cout << std::setprecision(2) << std::setw(8) << distribution.ipc
+		          << std::setprecision(3) << std::setw(12) << distribution.cache_misses
+		          << std::setw(12) << distribution.branch_misses;
+	}
+
+	std::cout << std::endl << std::defaultfloat;
+}
+
+inline void report(std::string_view name, double baseline_ns, double candidate_ns)
+{
+	std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(2)
+	          << std::setw(10) << baseline_ns << " ns"
+	          << std::setw(10) << candidate_ns << " ns"
+	          << std::setw(8) << (baseline_ns / candidate_ns) << "x" << std::endl;
+	std::cout << std::defaultfloat;
+}
+
+} // namespace sqh::bench
+
+#endif // INCLUDE_SQH_BENCHMARK_HPP
@@ -0,0 +1,295 @@
+/**
+ * @file Kernels.cpp
+ * @author Eliot Fondere
+ * @brief Implementation of Kernels.hpp
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "Kernels.hpp"
+#include "Benchmark.hpp"
+
+#include <squashlib/squash/SquashImage.hpp>
+
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace sqh
+{
+
+// friend of SquashImage, forwards to its private block kernels
+struct KernelAccess
+{
+	using Pixels = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>;
+	using Coefficients = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>;
+	using Table = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>;
+
+	static const BlockTransform& dct() { return SquashImage::dct_transform(); }
+	static const BlockTransform& haar() { return SquashImage::haar_transform(); }
+
+	static const Table& dctQTable(const SquashImage& image) { return image.m_dctQTable; }
+	static const Table& haarQTable(const SquashImage& image) { return image.m_haarQTable; }
+	static const Table& dctQReciprocal(const SquashImage& image) { return image.m_dctQReciprocal; }
+	static const Table& haarQReciprocal(const SquashImage& image) { return image.m_haarQReciprocal; }
+
+	static Coefficients transform_block(const Pixels& block, const BlockTransform& transform, const Table& reciprocal)
+	{
+		return SquashImage::transform_block(block, transform, reciprocal);
+	}
+
+	static void compress_block(const Coefficients& coefficients, CompressedBlock& compressed_block, bool isHaar)
+	{
+		SquashImage::compress_block(coefficients, compressed_block, isHaar);
+	}
+
+	static Coefficients decompress_block(std::istream& input, uint8_t info_byte)
+	{
+		return SquashImage::decompress_block(input, info_byte);
+	}
+
+	static Pixels inverse_transform_block(std::istream& input, uint8_t info_byte, const BlockTransform& transform,
+	                                      const Table& quantization_matrix)
+	{
+		return SquashImage::inverse_transform_block(input, info_byte, transform, quantization_matrix);
+	}
+
+	static const char* packing_path() { return SquashImage::packing_path(); }
+
+	static size_t getCompressedSize(CompressedBlock& compressed_block)
+	{
+		return SquashImage::getCompressedSize(compressed_block);
+	}
+
+	static double computeCompressionQuality(const Pixels& original, const Pixels& compressed, size_t compressed_size)
+	{
+		return SquashImage::computeCompressionQuality(original, compressed, compressed_size);
+	}
+};
+
+namespace bench
+{
+
+namespace
+{
+
+using Pixels = KernelAccess::Pixels;
+using Coefficients = KernelAccess::Coefficients;
+
+constexpr size_t KERNEL_BLOCKS = 4096;
+constexpr uint32_t SEED = 0x5175A54;
+
+enum class BlockKind
+{
+	Flat,
+	Gradient,
+	TextEdges,
+	Noise,
+};
+
+constexpr std::pair<BlockKind, const char*> BLOCK_KINDS[] = {
+	{BlockKind::Flat, "flat"},
+	{BlockKind::Gradient, "gradient"},
+	{BlockKind::TextEdges, "text edges"},
+	{BlockKind::Noise, "noise"},
+};
+
+uint8_t clamp_pixel(int value)
+{
+	return static_cast<uint8_t>(std::clamp(value, 0, 255));
+}
+
+Pixels make_block(BlockKind kind, std::mt19937& rng)
+{
+	std::uniform_int_distribution<int> pixel(0, 255);
+	Pixels block;
+
+	switch (kind)
+	{
+	case BlockKind::Flat:
+	{
+		auto value = static_cast<uint8_t>(pixel(rng));
+		block = Pixels::FromFunction([value](size_t, size_t) { return value; });
+		break;
+	}
+	case BlockKind::Gradient:
+	{
+		std::uniform_int_distribution<int> slope(-12, 12);
+		int base = pixel(rng);
+		int dx = slope(rng);
+		int dy = slope(rng);
+		block = Pixels::FromFunction([=](size_t i, size_t j) {
+			return clamp_pixel(base + dx * static_cast<int>(j) + dy * static_cast<int>(i));
+		});
+		break;
+	}
+	case BlockKind::TextEdges:
+	{
+		// dark strokes, one or two pixels wide, on a light background
+		std::uniform_int_distribution<int> background(220, 255);
+		std::uniform_int_distribution<int> ink(0, 40);
+		std::uniform_int_distribution<size_t> position(0, BLOCK_SIZE - 2);
+		std::uniform_int_distribution<int> strokes(1, 3);
+
+		auto value = static_cast<uint8_t>(background(rng));
+		block = Pixels::FromFunction([value](size_t, size_t) { return value; });
+
+		for (int s = strokes(rng); s > 0; s--)
+		{
+			bool vertical = rng() & 1;
+			size_t start = position(rng);
+			size_t width = 1 + (rng() & 1);
+			auto color = static_cast<uint8_t>(ink(rng));
+
+			for (size_t k = 0; k < BLOCK_SIZE; k++)
+			{
+				for (size_t w = start; w < start + width; w++)
+				{
+					(vertical ? block.data[k][w] : block.data[w][k]) = color;
+				}
+			}
+		}
+		break;
+	}
+	case BlockKind::Noise:
+		block = Pixels::FromFunction([&](size_t, size_t) { return static_cast<uint8_t>(pixel(rng)); });
+		break;
+	}
+
+	return block;
+}
+
+void write_block(std::string& output, const CompressedBlock& block)
+{
+	output.push_back(static_cast<char>(block.infoByte));
+	if (block.infoByte & static_cast<uint8_t>(InfoByte::IsLong))
+		output.append(reinterpret_cast<const char*>(&block.table), sizeof(block.table));
+	output.append(reinterpret_cast<const char*>(block.data), block.dataCount);
+}
+
+void bench_distribution(BlockKind kind, const char* kind_name, const SquashImage& image,
+                        trace::PerfCounters* counters)
+{
+	std::mt19937 rng(SEED + static_cast<uint32_t>(kind));
+
+	const auto& dct_table = KernelAccess::dctQTable(image);
+	const auto& dct_reciprocal = KernelAccess::dctQReciprocal(image);
+	const auto& haar_reciprocal = KernelAccess::haarQReciprocal(image);
+
+	// inputs of every kernel, prepared with the kernel before it
+	std::vector<Pixels> blocks(KERNEL_BLOCKS);
+	std::vector<Coefficients> coefficients(KERNEL_BLOCKS);
+	std::vector<CompressedBlock> compressed(KERNEL_BLOCKS);
+	std::vector<Pixels> reconstructed(KERNEL_BLOCKS);
+	std::string stream_data;
+
+	for (size_t k = 0; k < KERNEL_BLOCKS; k++)
+	{
+		blocks[k] = make_block(kind, rng);
+		coefficients[k] = KernelAccess::transform_block(blocks[k], KernelAccess::dct(), dct_reciprocal);
+		compressed[k] = CompressedBlock{};
+		KernelAccess::compress_block(coefficients[k], compressed[k], false);
+		write_block(stream_data, compressed[k]);
+	}
+
+	std::istringstream stream(stream_data);
+	for (size_t k = 0; k < KERNEL_BLOCKS; k++)
+	{
+		auto info_byte = static_cast<uint8_t>(stream.get());
+		reconstructed[k] = KernelAccess::inverse_transform_block(stream, info_byte, KernelAccess::dct(), dct_table);
+	}
+
+	auto run = [&](const char* kernel, auto&& function) {
+		report(std::string(kernel) + " (" + kind_name + ")", sample(function, KERNEL_BLOCKS, 51, 5, counters));
+	};
+
+	run("transform_block dct", [&] {
+		for (const auto& block : blocks)
+			do_not_optimize(KernelAccess::transform_block(block, KernelAccess::dct(), dct_reciprocal));
+	});
+
+	run("transform_block haar", [&] {
+		for (const auto& block : blocks)
+			do_not_optimize(KernelAccess::transform_block(block, KernelAccess::haar(), haar_reciprocal));
+	});
+
+	run("compress_block", [&] {
+		for (const auto& block : coefficients)
+		{
+			CompressedBlock result{};
+			KernelAccess::compress_block(block, result, false);
+			do_not_optimize(result);
+		}
+	});
+
+	run("decompress_block", [&] {
+		stream.clear();
+		stream.seekg(0);
+		for (size_t k = 0; k < KERNEL_BLOCKS; k++)
+		{
+			auto info_byte = static_cast<uint8_t>(stream.get());
+			do_not_optimize(KernelAccess::decompress_block(stream, info_byte));
+		}
+	});
+
+	run("inverse_transform_block", [&] {
+		stream.clear();
+		stream.seekg(0);
+		for (size_t k = 0; k < KERNEL_BLOCKS; k++)
+		{
+			auto info_byte = static_cast<uint8_t>(stream.get());
+			do_not_optimize(KernelAccess::inverse_transform_block(stream, info_byte, KernelAccess::dct(), dct_table));
+		}
+	});
+
+	run("computeCompressionQuality", [&] {
+		for (size_t k = 0; k < KERNEL_BLOCKS; k++)
+		{
+			do_not_optimize(KernelAccess::computeCompressionQuality(
+				blocks[k], reconstructed[k], KernelAccess::getCompressedSize(compressed[k])));
+		}
+	});
+}
+
+} // namespace
+
+void bench_kernels(bool with_counters)
+{
+	std::optional<trace::PerfCounters> counters;
+	if (with_counters)
+	{
+		counters.emplace();
+		if (!counters->available())
+		{
+			std::cout << "[ERROR] (squashbench): Hardware counters are not available, they will not be reported" << std::endl;
+			counters.reset();
+		}
+	}
+
+	std::cout << "--- SquashImage kernels (ns per block, cycles are time stamp counter ticks";
+	if (counters)
+		std::cout << ", misses are per block";
+	std::cout << ") ---" << std::endl;
+	std::cout << "compress block packs with: " << KernelAccess::packing_path() << std::endl;
+
+	std::cout << std::left << std::setw(40) << "kernel" << std::right
+	          << std::setw(10) << "min" << std::setw(10) << "median" << std::setw(10) << "p99"
+	          << std::setw(10) << "cycles";
+	if (counters)
+		std::cout << std::setw(8) << "ipc" << std::setw(12) << "cache miss" << std::setw(12) << "branch miss";
+	std::cout << std::endl;
+
+	// only used for its default quantization tables
+	SquashImage image;
+
+	for (const auto& [kind, kind_name] : BLOCK_KINDS)
+	{
+		bench_distribution(kind, kind_name, image, counters ? &*counters : nullptr);
+	}
+}
+
+} // namespace bench
+
+} // namespace sqh
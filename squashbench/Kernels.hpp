@@ -0,0 +1,21 @@
+/**
+ * @file Kernels.hpp
+ * @author Eliot Fondere
+ * @brief Benchmarks of the SquashImage block kernels on synthetic blocks
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_KERNELS_HPP
+#define INCLUDE_SQH_KERNELS_HPP
+
+namespace sqh::bench
+{
+
+// times every block kernel of SquashImage on flat, gradient, text edge and noise blocks. with_counters adds the IPC,
+// cache misses and branch misses per block of each kernel, read from the hardware counters
+void bench_kernels(bool with_counters = false);
+
+} // namespace sqh::bench
+
+#endif // INCLUDE_SQH_KERNELS_HPP
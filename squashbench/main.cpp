@@ -0,0 +1,276 @@
+/**
+ * @file main.cpp
+ * @author Eliot Fondere
+ * @brief Microbenchmarks for the squashlib building blocks
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "Benchmark.hpp"
+#include "Kernels.hpp"
+
+#include <squashlib/math/Matrix.hpp>
+#include <squashlib/squash/BlockWriter.hpp>
+#include <squashlib/squash/SquashHeader.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+using namespace sqh;
+
+namespace
+{
+
+using Block = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>;
+
+constexpr size_t ITERATIONS = 200000;
+
+// blocks written per file by the writer benchmark (about a 4 MP image)
+constexpr size_t WRITER_BLOCKS = 200000;
+
+constexpr std::array<math::MatrixIndex, BLOCK_SIZE * BLOCK_SIZE> zig_zag_indices =
+	{{
+		{0, 0},
+		{0, 1}, {1, 0},
+		{2, 0}, {1, 1}, {0, 2},
+		{0, 3}, {1, 2}, {2, 1}, {3, 0},
+		{4, 0}, {3, 1}, {2, 2}, {1, 3}, {0, 4},
+		{0, 5}, {1, 4}, {2, 3}, {3, 2}, {4, 1}, {5, 0},
+		{6, 0}, {5, 1}, {4, 2}, {3, 3}, {2, 4}, {1, 5}, {0, 6},
+		{0, 7}, {1, 6}, {2, 5}, {3, 4}, {4, 3}, {5, 2}, {6, 1}, {7, 0},
+		{7, 1}, {6, 2}, {5, 3}, {4, 4}, {3, 5}, {2, 6}, {1, 7},
+		{2, 7}, {3, 6}, {4, 5}, {5, 4}, {6, 3}, {7, 2},
+		{7, 3}, {6, 4}, {5, 5}, {4, 6}, {3, 7},
+		{4, 7}, {5, 6}, {6, 5}, {7, 4},
+		{7, 5}, {6, 6}, {5, 7},
+		{6, 7}, {7, 6},
+		{7, 7},
+	}};
+
+constexpr auto raster_indices = math::raster_order<BLOCK_SIZE, BLOCK_SIZE>();
+
+// the std::function based implementations Matrix used to have, kept here as a reference point
+namespace legacy
+{
+
+Block FromFunction(const std::function<int8_t(size_t, size_t)>& function)
+{
+	Block m;
+	for (size_t i = 0; i < BLOCK_SIZE; i++)
+		for (size_t j = 0; j < BLOCK_SIZE; j++)
+			m.data[i][j] = function(i, j);
+	return m;
+}
+
+std::array<int8_t, BLOCK_SIZE * BLOCK_SIZE> flatten(const Block& block,
+                                                    const std::function<math::MatrixIndex(size_t)>& flatten_function)
+{
+	std::array<int8_t, BLOCK_SIZE * BLOCK_SIZE> array;
+	for (size_t i = 0; i < array.size(); i++)
+	{
+		math::MatrixIndex index = flatten_function(i);
+		array.at(i) = block.data[index.i][index.j];
+	}
+	return array;
+}
+
+math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> asType2(const Block& block, const std::function<float(int8_t)>& function)
+{
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> m;
+	for (size_t j = 0; j < BLOCK_SIZE; j++)
+		for (size_t i = 0; i < BLOCK_SIZE; i++)
+			m.data[i][j] = function(block.data[i][j]);
+	return m;
+}
+
+} // namespace legacy
+
+Block make_block(size_t seed)
+{
+	return Block::FromFunction([seed](size_t i, size_t j) {
+		return static_cast<int8_t>((i * 31 + j * 17 + seed) % 23) - 11;
+	});
+}
+
+void bench_matrix()
+{
+	std::cout << "--- Matrix (std::function vs template) ---" << std::endl;
+
+	Block block = make_block(3);
+	size_t seed = 0;
+
+	auto generator = [&seed](size_t i, size_t j) { return static_cast<int8_t>(i * 8 + j + seed); };
+	bench::report("FromFunction",
+		bench::measure([&] { seed++; bench::do_not_optimize(legacy::FromFunction(generator)); }, ITERATIONS),
+		bench::measure([&] { seed++; bench::do_not_optimize(Block::FromFunction(generator)); }, ITERATIONS));
+
+	auto zig_zag = [](size_t index) { return zig_zag_indices[index]; };
+	bench::report("flatten (zig-zag)",
+		bench::measure([&] { bench::do_not_optimize(block); bench::do_not_optimize(legacy::flatten(block, zig_zag)); }, ITERATIONS),
+		bench::measure([&] { bench::do_not_optimize(block); bench::do_not_optimize(block.flatten<zig_zag_indices>()); }, ITERATIONS));
+
+	auto raster = [](size_t index) { return math::MatrixIndex{index / BLOCK_SIZE, index % BLOCK_SIZE}; };
+	bench::report("flatten (raster)",
+		bench::measure([&] { bench::do_not_optimize(block); bench::do_not_optimize(legacy::flatten(block, raster)); }, ITERATIONS),
+		bench::measure([&] { bench::do_not_optimize(block); bench::do_not_optimize(block.flatten<raster_indices>()); }, ITERATIONS));
+
+	auto shift = [](int8_t value) { return static_cast<float>(value) - 128.f; };
+	bench::report("asType2",
+		bench::measure([&] { bench::do_not_optimize(block); bench::do_not_optimize(legacy::asType2(block, shift)); }, ITERATIONS),
+		bench::measure([&] { bench::do_not_optimize(block); bench::do_not_optimize(block.asType2<float>(shift)); }, ITERATIONS));
+}
+
+void bench_expressions()
+{
+	std::cout << "--- Matrix (eager temporaries vs fused expressions) ---" << std::endl;
+
+	using FloatBlock = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>;
+
+	auto coefficients = FloatBlock::FromFunction([](size_t i, size_t j) {
+		return static_cast<float>(i * 37 + j * 11) - 200.f;
+	});
+	auto quantization = FloatBlock::FromFunction([](size_t i, size_t j) {
+		return static_cast<float>(10 + 6 * (i + j));
+	});
+
+	// every intermediate is materialised, as the operators used to do
+	bench::report("quantize (X / Q + 0.5).floor()",
+		bench::measure([&] {
+			bench::do_not_optimize(coefficients);
+			FloatBlock scaled = (coefficients / quantization).eval();
+			FloatBlock rounded = (scaled + 0.5f).eval();
+			FloatBlock floored = rounded.floor().eval();
+			Block result = floored.cast<int8_t>().eval();
+			bench::do_not_optimize(result);
+		}, ITERATIONS),
+		bench::measure([&] {
+			bench::do_not_optimize(coefficients);
+			Block result = (coefficients / quantization + 0.5f).floor().cast<int8_t>();
+			bench::do_not_optimize(result);
+		}, ITERATIONS));
+
+	auto reciprocal = FloatBlock::FromFunction([&quantization](size_t i, size_t j) {
+		return 1.f / quantization.data[i][j];
+	});
+	bench::report("quantize X / Q vs X * (1 / Q)",
+		bench::measure([&] {
+			bench::do_not_optimize(coefficients);
+			Block result = (coefficients / quantization + 0.5f).floor().cast<int8_t>();
+			bench::do_not_optimize(result);
+		}, ITERATIONS),
+		bench::measure([&] {
+			bench::do_not_optimize(coefficients);
+			Block result = (coefficients * reciprocal + 0.5f).floor().cast<int8_t>();
+			bench::do_not_optimize(result);
+		}, ITERATIONS));
+
+	bench::report("dequantize/clamp",
+		bench::measure([&] {
+			bench::do_not_optimize(coefficients);
+			FloatBlock shifted = (coefficients + 128.f).eval();
+			FloatBlock floored = shifted.floor().eval();
+			FloatBlock clamped = floored.clamp(0.f, 255.f).eval();
+			auto result = clamped.cast<uint8_t>().eval();
+			bench::do_not_optimize(result);
+		}, ITERATIONS),
+		bench::measure([&] {
+			bench::do_not_optimize(coefficients);
+			math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> result = (coefficients + 128.f).floor().clamp(0.f, 255.f).cast<uint8_t>();
+			bench::do_not_optimize(result);
+		}, ITERATIONS));
+}
+
+// a mix of short and long blocks of various lengths, roughly what a photo produces
+std::vector<CompressedBlock> make_compressed_blocks(size_t count)
+{
+	std::vector<CompressedBlock> blocks(count);
+
+	for (size_t k = 0; k < count; k++)
+	{
+		CompressedBlock& block = blocks[k];
+		bool isLong = (k % 7) == 0;
+
+		block.dataCount = static_cast<uint8_t>(isLong ? 20 + k % 40 : k % 24);
+		block.infoByte = static_cast<uint8_t>(isLong ? static_cast<uint8_t>(InfoByte::IsLong) : block.dataCount);
+		block.table = isLong ? 0xF0F0F0F0F0F0F0F0 ^ k : 0;
+		for (size_t i = 0; i < block.dataCount; i++)
+		{
+			block.data[i] = static_cast<int8_t>(k + i);
+		}
+	}
+
+	return blocks;
+}
+
+void bench_writer()
+{
+	std::cout << "--- BlockWriter (per-block ofstream writes vs buffered, ns per block) ---" << std::endl;
+
+	auto blocks = make_compressed_blocks(WRITER_BLOCKS);
+	auto file_path = std::filesystem::temp_directory_path() / "squashbench.sqh";
+	auto per_block = [](double ns) { return ns / static_cast<double>(WRITER_BLOCKS); };
+
+	// what SquashImage::compress used to do
+	double stream_ns = bench::measure([&] {
+		std::ofstream output_file(file_path, std::ios::binary);
+		for (const auto& block : blocks)
+		{
+			output_file.write(reinterpret_cast<const char*>(&block.infoByte), sizeof(block.infoByte));
+			if (block.infoByte & static_cast<uint8_t>(InfoByte::IsLong))
+				output_file.write(reinterpret_cast<const char*>(&block.table), sizeof(block.table));
+			output_file.write(reinterpret_cast<const char*>(&block.data), sizeof(int8_t) * block.dataCount);
+		}
+	}, 1);
+
+	double writer_ns = bench::measure([&] {
+		std::ofstream output_file(file_path, std::ios::binary);
+		BlockWriter output(output_file);
+		for (const auto& block : blocks)
+		{
+			output.writeBlock(block);
+		}
+		output.flush();
+	}, 1);
+
+	bench::report("write blocks", per_block(stream_ns), per_block(writer_ns));
+
+	std::filesystem::remove(file_path);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	// "micro" or "kernels" only runs that part, "--counters" reads hardware counters around the kernels
+	std::string_view only;
+	bool with_counters = false;
+	for (int k = 1; k < argc; k++)
+	{
+		std::string_view argument = argv[k];
+		if (argument == "--counters")
+			with_counters = true;
+		else
+			only = argument;
+	}
+
+	if (only.empty() || only == "micro")
+	{
+		std::cout << std::left << std::setw(32) << "benchmark" << std::right
+		          << std::setw(13) << "baseline" << std::setw(13) << "current" << std::setw(9) << "speedup" << std::endl;
+
+		bench_matrix();
+		bench_expressions();
+		bench_writer();
+	}
+
+	if (only.empty() || only == "kernels")
+	{
+		bench::bench_kernels(with_counters);
+	}
+
+	return 0;
+}
@@ -13,7 +13,9 @@
 #include "argparse/argparse.hpp"
 #include "squashlib/squash/SquashImage.hpp"
 
+#include <fstream>
 #include <iostream>
+#include <vector>
 
 int main(int argc, char* argv[])
 {
@@ -34,6 +36,43 @@ int main(int argc, char* argv[])
 		.required()
 		.metavar("output file")
 		.help("the output file to save the compressed or decompressed data");
+	program.add_argument("-q", "--quality")
+		.default_value(0.8)
+		.scan<'g', double>()
+		.help("requested compression quality of the blocks");
+	program.add_argument("-j", "--threads")
+		.default_value(1u)
+		.scan<'u', unsigned int>()
+		.help("number of threads encoding the image (0: every hardware thread)");
+	program.add_argument("--optimize")
+		.implicit_value(true)
+		.default_value(false)
+		.help("tune the quantization tables for the requested quality before compressing");
+	program.add_argument("--qtables")
+		.metavar("profile file")
+		.help("compress with the quantization tables of a profile trained by squashtrain");
+	program.add_argument("--target-size")
+		.metavar("bytes")
+		.scan<'u', uint64_t>()
+		.help("compress at the best quality whose file fits in this many bytes");
+	program.add_argument("--tile-size")
+		.default_value(0u)
+		.scan<'u', unsigned int>()
+		.metavar("pixels")
+		.help("split the compressed image in independently decodable tiles of this size (a multiple of 8, 0: no tiles)");
+	program.add_argument("--progressive")
+		.implicit_value(true)
+		.default_value(false)
+		.help("order the compressed data by frequency band, so that the start of the file decodes to a preview");
+	program.add_argument("--pyramid")
+		.default_value(1u)
+		.scan<'u', unsigned int>()
+		.metavar("levels")
+		.help("also store successive 2x downscales of the image, for this many resolution levels in total");
+	program.add_argument("--scale")
+		.default_value(1.f)
+		.scan<'g', float>()
+		.help("when decompressing a pyramid, decode the level closest to this scale of the image");
 
 	try {
 		program.parse_args(argc, argv);
@@ -55,17 +94,60 @@ int main(int argc, char* argv[])
 		std::exit(1);
 	}
 
+	if (program.is_used("--target-size") && program.get<unsigned int>("--pyramid") > 1)
+	{
+		std::cerr << "--target-size cannot be combined with --pyramid" << std::endl;
+		std::exit(1);
+	}
+
 
 	if (compress)
 	{
-		sqh::SquashImage::Quality = 0.8f;
 		sqh::SquashImage img(program.get("input"));
-		img.save(program.get("-o"), true);
+
+		if (auto profile = program.present("--qtables"); profile && !img.loadQTables(*profile))
+			std::exit(1);
+
+		sqh::EncodeStats stats;
+		sqh::EncoderOptions options;
+		options.quality = program.get<double>("--quality");
+		options.threads = program.get<unsigned int>("--threads");
+		options.optimizeQTables = program.get<bool>("--optimize");
+		options.tileSize = program.get<unsigned int>("--tile-size");
+		options.pyramidLevels = program.get<unsigned int>("--pyramid");
+		options.progressive = program.get<bool>("--progressive");
+		options.stats = &stats;
+
+		bool saved = false;
+		if (auto target_size = program.present<uint64_t>("--target-size"))
+		{
+			std::vector<uint8_t> encoded;
+			float scale = 0.f;
+			if (img.encodeToSize(encoded, *target_size, options, &scale))
+			{
+				std::ofstream output_file(program.get("-o"), std::ios::binary);
+				output_file.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+				saved = static_cast<bool>(output_file);
+
+				std::cout << encoded.size() << " bytes with the quantization tables scaled by " << scale << std::endl;
+			}
+		}
+		else
+		{
+			saved = img.save(program.get("-o"), true, options);
+		}
+
+		if (saved)
+		{
+			std::cout << "Compression success: " << stats.averageQuality << " compared to requested: "
+			          << stats.requestedQuality << std::endl;
+		}
 	}
 	else
 	{
-		sqh::SquashImage img(program.get("input"));
-		img.save(program.get("-o"), true);
+		sqh::SquashImage img;
+		if (img.open_sqh(program.get("input"), program.get<float>("--scale")))
+			img.save(program.get("-o"), true);
 	}
 
 	return 0;
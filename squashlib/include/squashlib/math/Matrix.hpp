@@ -11,15 +11,20 @@
 
 #include <cstddef>
 #include <algorithm>
-#include <functional>
+#include <array>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
+#include <iterator>
+#include <type_traits>
+
+#include <squashlib/math/MatrixExpression.hpp>
 
 namespace sqh::math
 {
 
 template<typename T, typename N_T>
-inline N_T default_conversion(T input)
+constexpr N_T default_conversion(T input)
 {
 	return static_cast<N_T>(input);
 }
@@ -30,46 +35,70 @@ struct MatrixIndex
 	size_t j;
 };
 
+// row by row flattening order, usable as a compile-time table for Matrix::flatten
+template<size_t R, size_t C>
+constexpr std::array<MatrixIndex, R * C> raster_order()
+{
+	std::array<MatrixIndex, R * C> order{};
+
+	for (size_t k = 0; k < R * C; k++)
+	{
+		order[k] = {k / C, k % C};
+	}
+
+	return order;
+}
+
 template<size_t R, size_t C, typename T>
-class Matrix
+class Matrix : public MatrixExpression<Matrix<R, C, T>>
 {
 public:
-	Matrix();
-	static Matrix<R, C, T> FromFunction(std::function<T(size_t, size_t)> function);
-	static Matrix<R, C, T> FromArray(T array[R][C]);
-	static Matrix<R, C, T> Outer(Matrix<1, C, T> rows, Matrix<R, 1, T> columns);
-	static Matrix<R, C, T> Identity();
-	static Matrix<R, C, T> Transpose(const Matrix<C, R, T>& other);
+	static constexpr size_t rows = R;
+	static constexpr size_t cols = C;
+	using value_type = T;
+
+	constexpr Matrix();
 
-	Matrix<R, 1, T> getColumn(size_t index);
-	Matrix<1, C, T> getRow(size_t index);
-	Matrix<C, 1, T> getRowT(size_t index);
+	// evaluates an element-wise expression (see MatrixExpression.hpp) in a single pass
+	template<typename E>
+	Matrix(const MatrixExpression<E>& expression);
+	template<typename E>
+	Matrix<R, C, T>& operator=(const MatrixExpression<E>& expression);
+	template<typename F>
+	static constexpr Matrix<R, C, T> FromFunction(F&& function);
+	static constexpr Matrix<R, C, T> FromArray(const T array[R][C]);
+	static constexpr Matrix<R, C, T> Outer(Matrix<1, C, T> rows, Matrix<R, 1, T> columns);
+	static constexpr Matrix<R, C, T> Identity();
+	static constexpr Matrix<R, C, T> Transpose(const Matrix<C, R, T>& other);
 
-	std::array<T, R * C> flatten(const std::function<MatrixIndex(size_t)>& flatten_function) const;
-	std::array<T, R * C> flatten(const std::function<MatrixIndex(size_t, size_t, size_t)>& flatten_function) const;
+	constexpr Matrix<R, 1, T> getColumn(size_t index) const;
+	constexpr Matrix<1, C, T> getRow(size_t index) const;
+	constexpr Matrix<C, 1, T> getRowT(size_t index) const;
 
-	template<typename N_T>
-	Matrix<C, R, N_T> asType2(const std::function<N_T(T)>& conversion_function) const;
+	// flatten_function is called either as f(index) or f(index, R, C) and returns the MatrixIndex to read
+	template<typename F>
+	constexpr std::array<T, R * C> flatten(F&& flatten_function) const;
 
-	template<typename N_T>
-	Matrix<C, R, N_T> asType(N_T(*conversion_function)(T)=default_conversion) const;
+	// Order is a constexpr table of R * C MatrixIndex (see raster_order())
+	template<const auto& Order>
+	constexpr std::array<T, R * C> flatten() const;
 
-	Matrix<C, R, T> transpose() const;
+	template<typename N_T, typename F>
+	constexpr Matrix<C, R, N_T> asType2(F&& conversion_function) const;
 
-	Matrix<R, C, T> operator+(T scalar);
-	Matrix<R, C, T> operator-(T scalar);
-	Matrix<R, C, T> operator*(T scalar);
-	Matrix<R, C, T> operator/(T scalar);
+	template<typename N_T, typename F = N_T(*)(T)>
+	constexpr Matrix<C, R, N_T> asType(F conversion_function = default_conversion<T, N_T>) const;
 
-	Matrix<R, C, T> operator+(const Matrix<R, C, T>& other);
-	Matrix<R, C, T> operator-(const Matrix<R, C, T>& other);
-	Matrix<R, C, T> operator*(const Matrix<R, C, T>& other);
-	Matrix<R, C, T> operator/(const Matrix<R, C, T>& other);
+	constexpr Matrix<C, R, T> transpose() const;
+
+	// row-major element access, used when evaluating expressions. The flat pointer keeps evaluation loops simple enough
+	// to vectorize, which also means that expressions cannot be evaluated in constant expressions.
+	T element(size_t index) const { return (&data[0][0])[index]; }
 
 	template<size_t C_2>
-	Matrix<R, C_2, T> product(const Matrix<C, C_2, T>& other) const;
+	constexpr Matrix<R, C_2, T> product(const Matrix<C, C_2, T>& other) const;
 
-	T dot(const Matrix<R, C, T>& other) const;
+	constexpr T dot(const Matrix<R, C, T>& other) const;
 	T norm() const;
 	T normalized_dot(const Matrix<R, C, T>& other) const;
 
@@ -83,7 +112,7 @@ public:
 
 // IMPLEMENTATION
 template<size_t R, size_t C, typename T>
-Matrix<R, C, T>::Matrix()
+constexpr Matrix<R, C, T>::Matrix()
 	: data{}
 {
 	static_assert(R != 0, "Matrix cannot have 0 rows.");
@@ -91,7 +120,35 @@ Matrix<R, C, T>::Matrix()
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::FromFunction(std::function<T(size_t, size_t)> function)
+template<typename E>
+Matrix<R, C, T>::Matrix(const MatrixExpression<E>& expression)
+	: data{}
+{
+	*this = expression;
+}
+
+template<size_t R, size_t C, typename T>
+template<typename E>
+Matrix<R, C, T>& Matrix<R, C, T>::operator=(const MatrixExpression<E>& expression)
+{
+	static_assert(E::rows == R && E::cols == C, "Matrix dimensions do not match. (At Matrix::operator=)");
+	static_assert(std::is_same_v<typename E::value_type, T>,
+	              "Expression type does not match the matrix type, use cast<T>(). (At Matrix::operator=)");
+
+	// element-wise expressions only read element k to produce element k, so evaluating in place is safe
+	const E& e = expression.derived();
+	T* output = &data[0][0];
+	for (size_t k = 0; k < R * C; k++)
+	{
+		output[k] = e.element(k);
+	}
+
+	return *this;
+}
+
+template<size_t R, size_t C, typename T>
+template<typename F>
+constexpr Matrix<R, C, T> Matrix<R, C, T>::FromFunction(F&& function)
 {
 	Matrix<R, C, T> m;
 
@@ -107,7 +164,7 @@ Matrix<R, C, T> Matrix<R, C, T>::FromFunction(std::function<T(size_t, size_t)> f
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::FromArray(T array[R][C]) {
+constexpr Matrix<R, C, T> Matrix<R, C, T>::FromArray(const T array[R][C]) {
 	Matrix<R, C, T> m;
 
 	for (size_t j = 0; j < C; j++)
@@ -122,7 +179,7 @@ Matrix<R, C, T> Matrix<R, C, T>::FromArray(T array[R][C]) {
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::Outer(Matrix<1, C, T> rows, Matrix<R, 1, T> columns)
+constexpr Matrix<R, C, T> Matrix<R, C, T>::Outer(Matrix<1, C, T> rows, Matrix<R, 1, T> columns)
 {
 	Matrix<R, C, T> m;
 
@@ -138,7 +195,7 @@ Matrix<R, C, T> Matrix<R, C, T>::Outer(Matrix<1, C, T> rows, Matrix<R, 1, T> col
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::Identity()
+constexpr Matrix<R, C, T> Matrix<R, C, T>::Identity()
 {
 	static_assert(R == C, "Matrix is not square. (At Matrix::Identity)");
 
@@ -152,13 +209,13 @@ Matrix<R, C, T> Matrix<R, C, T>::Identity()
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::Transpose(const Matrix<C, R, T> &other)
+constexpr Matrix<R, C, T> Matrix<R, C, T>::Transpose(const Matrix<C, R, T> &other)
 {
 	return other.transpose();
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<R, 1, T> Matrix<R, C, T>::getColumn(size_t index)
+constexpr Matrix<R, 1, T> Matrix<R, C, T>::getColumn(size_t index) const
 {
 	Matrix<R, 1, T> m;
 
@@ -171,7 +228,7 @@ Matrix<R, 1, T> Matrix<R, C, T>::getColumn(size_t index)
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<1, C, T> Matrix<R, C, T>::getRow(size_t index)
+constexpr Matrix<1, C, T> Matrix<R, C, T>::getRow(size_t index) const
 {
 	Matrix<1, C, T> m;
 
@@ -184,7 +241,7 @@ Matrix<1, C, T> Matrix<R, C, T>::getRow(size_t index)
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<C, 1, T> Matrix<R, C, T>::getRowT(size_t index)
+constexpr Matrix<C, 1, T> Matrix<R, C, T>::getRowT(size_t index) const
 {
 	Matrix<1, C, T> m;
 
@@ -197,36 +254,44 @@ Matrix<C, 1, T> Matrix<R, C, T>::getRowT(size_t index)
 }
 
 template<size_t R, size_t C, typename T>
-std::array<T, R * C> Matrix<R, C, T>::flatten(const std::function<MatrixIndex(size_t)>& flatten_function) const
+template<typename F>
+constexpr std::array<T, R * C> Matrix<R, C, T>::flatten(F&& flatten_function) const
 {
-	std::array<T, R * C> array;
+	std::array<T, R * C> array{};
 
 	for (size_t i = 0; i < array.size(); i++)
 	{
-		MatrixIndex index = flatten_function(i);
-		array.at(i) = data[index.i][index.j];
+		MatrixIndex index{};
+		if constexpr (std::is_invocable_v<F, size_t>)
+			index = flatten_function(i);
+		else
+			index = flatten_function(i, R, C);
+
+		array[i] = data[index.i][index.j];
 	}
 
 	return array;
 }
 
 template<size_t R, size_t C, typename T>
-std::array<T, R * C> Matrix<R, C, T>::flatten(const std::function<MatrixIndex(size_t, size_t, size_t)>& flatten_function) const
+template<const auto& Order>
+constexpr std::array<T, R * C> Matrix<R, C, T>::flatten() const
 {
-	std::array<T, R * C> array;
+	static_assert(std::size(Order) == R * C, "Flattening order does not match the matrix size. (At Matrix::flatten)");
+
+	std::array<T, R * C> array{};
 
 	for (size_t i = 0; i < array.size(); i++)
 	{
-		MatrixIndex index = flatten_function(i, R, C);
-		array.at(i) = data[index.i][index.j];
+		array[i] = data[Order[i].i][Order[i].j];
 	}
 
 	return array;
 }
 
 template<size_t R, size_t C, typename T>
-template<typename N_T>
-Matrix<C, R, N_T> Matrix<R, C, T>::asType2(const std::function<N_T(T)>& conversion_function) const
+template<typename N_T, typename F>
+constexpr Matrix<C, R, N_T> Matrix<R, C, T>::asType2(F&& conversion_function) const
 {
 	Matrix<C, R, N_T> m;
 
@@ -242,8 +307,8 @@ Matrix<C, R, N_T> Matrix<R, C, T>::asType2(const std::function<N_T(T)>& conversi
 }
 
 template<size_t R, size_t C, typename T>
-template<typename N_T>
-Matrix<C, R, N_T> Matrix<R, C, T>::asType(N_T(*conversion_function)(T)) const
+template<typename N_T, typename F>
+constexpr Matrix<C, R, N_T> Matrix<R, C, T>::asType(F conversion_function) const
 {
 	Matrix<C, R, N_T> m;
 
@@ -259,7 +324,7 @@ Matrix<C, R, N_T> Matrix<R, C, T>::asType(N_T(*conversion_function)(T)) const
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<C, R, T> Matrix<R, C, T>::transpose() const {
+constexpr Matrix<C, R, T> Matrix<R, C, T>::transpose() const {
 	Matrix<C, R, T> m;
 
 	for (size_t i = 0; i < C; i++)
@@ -274,132 +339,7 @@ Matrix<C, R, T> Matrix<R, C, T>::transpose() const {
 }
 
 template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator+(T scalar)
-{
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] + scalar;
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator-(T scalar)
-{
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] - scalar;
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator*(T scalar)
-{
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] * scalar;
-		}
-	}
-
-	return m;
-}
-
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator/(T scalar)
-{
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] / scalar;
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator+(const Matrix<R, C, T>& other) {
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] + other.data[i][j];
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator-(const Matrix<R, C, T>& other) {
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] - other.data[i][j];
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator*(const Matrix<R, C, T>& other) {
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] * other.data[i][j];
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> Matrix<R, C, T>::operator/(const Matrix<R, C, T>& other) {
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = data[i][j] / other.data[i][j];
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-T Matrix<R, C, T>::dot(const Matrix<R, C, T>& other) const
+constexpr T Matrix<R, C, T>::dot(const Matrix<R, C, T>& other) const
 {
 	T sum = 0;
 	for (int i = 0; i < R; i++)
@@ -416,7 +356,7 @@ T Matrix<R, C, T>::dot(const Matrix<R, C, T>& other) const
 template<size_t R, size_t C, typename T>
 T Matrix<R, C, T>::norm() const
 {
-	return sqrt(dot(*this));
+	return std::sqrt(dot(*this));
 }
 
 template<size_t R, size_t C, typename T>
@@ -427,7 +367,7 @@ T Matrix<R, C, T>::normalized_dot(const Matrix<R, C, T> &other) const
 
 template<size_t R, size_t C, typename T>
 template<size_t C_2>
-Matrix<R, C_2, T> Matrix<R, C, T>::product(const Matrix<C, C_2, T>& other) const
+constexpr Matrix<R, C_2, T> Matrix<R, C, T>::product(const Matrix<C, C_2, T>& other) const
 {
 	Matrix<R, C_2, T> m;
 
@@ -505,38 +445,6 @@ void Matrix<R, C, T>::toStream(std::ostream &output_stream) const
 	output_stream << std::endl;
 }
 
-template<size_t R, size_t C, typename T>
-constexpr Matrix<R, C, T> operator*(T scalar, Matrix<R, C, T> matrix)
-{
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = matrix.data[i][j] * scalar;
-		}
-	}
-
-	return m;
-}
-
-template<size_t R, size_t C, typename T>
-Matrix<R, C, T> operator/(T scalar, const Matrix<R, C, T>& matrix)
-{
-	Matrix<R, C, T> m;
-
-	for (size_t j = 0; j < C; j++)
-	{
-		for (size_t i = 0; i < R; i++)
-		{
-			m.data[i][j] = scalar / matrix.data[i][j];
-		}
-	}
-
-	return m;
-}
-
 } // sqh::math
 
 #endif // INCLUDE_SQH_MATRIX_HPP
@@ -0,0 +1,275 @@
+/**
+ * @file MatrixExpression.hpp
+ * @author Eliot Fondere
+ * @brief Lazy element-wise matrix expressions, fused into a single loop when assigned to a Matrix
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_MATRIX_EXPRESSION_HPP
+#define INCLUDE_SQH_MATRIX_EXPRESSION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+namespace sqh::math
+{
+
+template<size_t R, size_t C, typename T>
+class Matrix;
+
+template<typename E>
+class MatrixExpression;
+
+template<typename E>
+constexpr bool is_matrix_expression_v = std::is_base_of_v<MatrixExpression<std::decay_t<E>>, std::decay_t<E>>;
+
+// operands are kept by reference when they are lvalues and by value when they are temporaries, so that an expression
+// built from e.g. the result of Matrix::product() can safely be stored in an auto variable
+template<typename E>
+using expression_operand_t = std::conditional_t<std::is_lvalue_reference_v<E>, const std::decay_t<E>&, std::decay_t<E>>;
+
+template<typename E, typename Op, typename N_T>
+class UnaryExpression;
+
+// every expression exposes rows, cols, value_type and element(index), where index runs over the rows * cols elements
+// in row-major order. Evaluating through a flat index gives the compiler a single simple loop to vectorize.
+template<typename E>
+class MatrixExpression
+{
+public:
+	constexpr const E& derived() const { return static_cast<const E&>(*this); }
+
+	constexpr auto floor() const&;
+	constexpr auto floor() &&;
+
+	template<typename N_T>
+	constexpr auto cast() const&;
+	template<typename N_T>
+	constexpr auto cast() &&;
+
+	template<typename T>
+	constexpr auto clamp(T low, T high) const&;
+	template<typename T>
+	constexpr auto clamp(T low, T high) &&;
+
+	// applies function to every element (the result type is the return type of function)
+	template<typename F>
+	constexpr auto map(F function) const&;
+	template<typename F>
+	constexpr auto map(F function) &&;
+
+	// evaluates the expression into a new matrix
+	constexpr auto eval() const;
+};
+
+template<typename T>
+class ScalarOperand
+{
+public:
+	constexpr explicit ScalarOperand(T value) : m_value(value) {}
+	constexpr T element(size_t) const { return m_value; }
+
+private:
+	T m_value;
+};
+
+template<typename L, typename R_, typename Op>
+class BinaryExpression : public MatrixExpression<BinaryExpression<L, R_, Op>>
+{
+	using Shape = std::decay_t<std::conditional_t<is_matrix_expression_v<L>, L, R_>>;
+
+public:
+	static constexpr size_t rows = Shape::rows;
+	static constexpr size_t cols = Shape::cols;
+	using value_type = typename Shape::value_type;
+
+	template<typename A, typename B>
+	constexpr BinaryExpression(A&& lhs, B&& rhs)
+		: m_lhs(std::forward<A>(lhs))
+		, m_rhs(std::forward<B>(rhs))
+	{}
+
+	constexpr value_type element(size_t index) const
+	{
+		return static_cast<value_type>(Op{}(m_lhs.element(index), m_rhs.element(index)));
+	}
+
+private:
+	expression_operand_t<L> m_lhs;
+	expression_operand_t<R_> m_rhs;
+};
+
+template<typename E, typename Op, typename N_T>
+class UnaryExpression : public MatrixExpression<UnaryExpression<E, Op, N_T>>
+{
+public:
+	static constexpr size_t rows = std::decay_t<E>::rows;
+	static constexpr size_t cols = std::decay_t<E>::cols;
+	using value_type = N_T;
+
+	template<typename A>
+	constexpr UnaryExpression(A&& operand, Op op)
+		: m_operand(std::forward<A>(operand))
+		, m_op(op)
+	{}
+
+	constexpr value_type element(size_t index) const
+	{
+		return static_cast<value_type>(m_op(m_operand.element(index)));
+	}
+
+private:
+	expression_operand_t<E> m_operand;
+	Op m_op;
+};
+
+namespace detail
+{
+
+template<typename To, typename From>
+To bit_cast(From value)
+{
+	static_assert(sizeof(To) == sizeof(From), "bit_cast requires types of the same size.");
+
+	To result;
+	std::memcpy(&result, &value, sizeof(To));
+	return result;
+}
+
+struct FloorOp
+{
+	template<typename T>
+	T operator()(T value) const
+	{
+		if constexpr (std::is_same_v<T, float>)
+		{
+			// std::floor is a library call without SSE4.1 and float comparisons are not if-converted by the vectorizer,
+			// so this only uses integer operations on the bits. It is exact, including -0, infinities and NaN.
+			const uint32_t bits = bit_cast<uint32_t>(value);
+
+			// all ones when |value| < 2^23, every float above that is already an integer
+			const uint32_t keep = 0u - static_cast<uint32_t>(((bits >> 23) & 0xFF) < 150);
+
+			const float truncated = static_cast<float>(static_cast<int32_t>(bit_cast<float>(bits & keep)));
+			const uint32_t negative_fraction = (bits >> 31)
+			                                   & static_cast<uint32_t>(bit_cast<uint32_t>(truncated) != bits)
+			                                   & static_cast<uint32_t>((bits << 1) != 0);
+			// the floor of a negative value is never +0: the sign is kept for -0
+			const uint32_t floored = bit_cast<uint32_t>(truncated - static_cast<float>(negative_fraction))
+			                         | (bits & 0x80000000u);
+
+			return bit_cast<float>((floored & keep) | (bits & ~keep));
+		}
+		else
+		{
+			return std::floor(value);
+		}
+	}
+};
+
+template<typename N_T>
+struct CastOp
+{
+	template<typename T>
+	constexpr N_T operator()(T value) const { return static_cast<N_T>(value); }
+};
+
+template<typename T>
+struct ClampOp
+{
+	T low;
+	T high;
+
+	constexpr T operator()(T value) const { return std::min(high, std::max(low, value)); }
+};
+
+template<typename Self, typename Op>
+constexpr auto make_unary(Self&& self, Op op)
+{
+	using E = std::decay_t<Self>;
+	using N_T = std::decay_t<decltype(op(std::declval<typename E::value_type>()))>;
+	return UnaryExpression<Self, Op, N_T>(std::forward<Self>(self), op);
+}
+
+template<typename L, typename R_>
+constexpr void check_shapes()
+{
+	static_assert(std::decay_t<L>::rows == std::decay_t<R_>::rows && std::decay_t<L>::cols == std::decay_t<R_>::cols,
+	              "Matrix dimensions do not match. (At MatrixExpression)");
+}
+
+} // namespace detail
+
+template<typename E>
+constexpr auto MatrixExpression<E>::floor() const& { return detail::make_unary(derived(), detail::FloorOp{}); }
+template<typename E>
+constexpr auto MatrixExpression<E>::floor() && { return detail::make_unary(std::move(static_cast<E&>(*this)), detail::FloorOp{}); }
+
+template<typename E>
+template<typename N_T>
+constexpr auto MatrixExpression<E>::cast() const& { return detail::make_unary(derived(), detail::CastOp<N_T>{}); }
+template<typename E>
+template<typename N_T>
+constexpr auto MatrixExpression<E>::cast() && { return detail::make_unary(std::move(static_cast<E&>(*this)), detail::CastOp<N_T>{}); }
+
+template<typename E>
+template<typename T>
+constexpr auto MatrixExpression<E>::clamp(T low, T high) const& { return detail::make_unary(derived(), detail::ClampOp<T>{low, high}); }
+template<typename E>
+template<typename T>
+constexpr auto MatrixExpression<E>::clamp(T low, T high) && { return detail::make_unary(std::move(static_cast<E&>(*this)), detail::ClampOp<T>{low, high}); }
+
+template<typename E>
+template<typename F>
+constexpr auto MatrixExpression<E>::map(F function) const& { return detail::make_unary(derived(), function); }
+template<typename E>
+template<typename F>
+constexpr auto MatrixExpression<E>::map(F function) && { return detail::make_unary(std::move(static_cast<E&>(*this)), function); }
+
+template<typename E>
+constexpr auto MatrixExpression<E>::eval() const
+{
+	return Matrix<E::rows, E::cols, typename E::value_type>(*this);
+}
+
+// --- OPERATORS ---
+#define SQH_MATRIX_EXPRESSION_OPERATOR(OP, FUNCTOR)                                                                      \
+	template<typename L, typename R_,                                                                                  \
+	         std::enable_if_t<is_matrix_expression_v<L> && is_matrix_expression_v<R_>, int> = 0>                       \
+	constexpr auto operator OP(L&& lhs, R_&& rhs)                                                                      \
+	{                                                                                                                  \
+		detail::check_shapes<L, R_>();                                                                                 \
+		return BinaryExpression<L, R_, FUNCTOR>(std::forward<L>(lhs), std::forward<R_>(rhs));                          \
+	}                                                                                                                  \
+                                                                                                                       \
+	template<typename L, std::enable_if_t<is_matrix_expression_v<L>, int> = 0>                                         \
+	constexpr auto operator OP(L&& lhs, typename std::decay_t<L>::value_type scalar)                                   \
+	{                                                                                                                  \
+		using S = ScalarOperand<typename std::decay_t<L>::value_type>;                                                 \
+		return BinaryExpression<L, S, FUNCTOR>(std::forward<L>(lhs), S(scalar));                                       \
+	}                                                                                                                  \
+                                                                                                                       \
+	template<typename R_, std::enable_if_t<is_matrix_expression_v<R_>, int> = 0>                                       \
+	constexpr auto operator OP(typename std::decay_t<R_>::value_type scalar, R_&& rhs)                                 \
+	{                                                                                                                  \
+		using S = ScalarOperand<typename std::decay_t<R_>::value_type>;                                                \
+		return BinaryExpression<S, R_, FUNCTOR>(S(scalar), std::forward<R_>(rhs));                                     \
+	}
+
+SQH_MATRIX_EXPRESSION_OPERATOR(+, std::plus<>)
+SQH_MATRIX_EXPRESSION_OPERATOR(-, std::minus<>)
+SQH_MATRIX_EXPRESSION_OPERATOR(*, std::multiplies<>)
+SQH_MATRIX_EXPRESSION_OPERATOR(/, std::divides<>)
+
+#undef SQH_MATRIX_EXPRESSION_OPERATOR
+
+} // namespace sqh::math
+
+#endif // INCLUDE_SQH_MATRIX_EXPRESSION_HPP
@@ -1,7 +1,7 @@
 /**
  * @file math.hpp
  * @author Eliot Fondere
- * @brief Defines some mathematical constants
+ * @brief Defines some mathematical constants and functions usable at compile time
  *
  * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
  */
@@ -15,6 +15,54 @@ namespace math
 
 constexpr float pi = 3.141592653589793f;
 
+// square root by Newton's method (x must be non-negative and finite)
+constexpr double constexpr_sqrt(double x)
+{
+	if (x == 0.0)
+		return 0.0;
+
+	double current = x > 1.0 ? x : 1.0;
+	double previous = 0.0;
+	while (current != previous)
+	{
+		previous = current;
+		current = 0.5 * (current + x / current);
+	}
+
+	return current;
+}
+
+// cosine from its Taylor series, after reducing x to [-pi, pi]
+constexpr double constexpr_cos(double x)
+{
+	constexpr double two_pi = 6.283185307179586476925286766559;
+
+	while (x > two_pi / 2)
+		x -= two_pi;
+	while (x < -two_pi / 2)
+		x += two_pi;
+
+	double term = 1.0;
+	double sum = 1.0;
+	for (int n = 1; n < 30; n++)
+	{
+		term *= -x * x / static_cast<double>((2 * n - 1) * (2 * n));
+		sum += term;
+	}
+
+	return sum;
+}
+
+constexpr float constexpr_sqrt(float x)
+{
+	return static_cast<float>(constexpr_sqrt(static_cast<double>(x)));
+}
+
+constexpr float constexpr_cos(float x)
+{
+	return static_cast<float>(constexpr_cos(static_cast<double>(x)));
+}
+
 }
 }
 
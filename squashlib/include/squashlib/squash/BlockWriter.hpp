@@ -0,0 +1,93 @@
+/**
+ * @file BlockWriter.hpp
+ * @author Eliot Fondere
+ * @brief Buffered writer used to emit the compressed blocks of a squash file
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_BLOCK_WRITER_HPP
+#define INCLUDE_SQH_BLOCK_WRITER_HPP
+
+#include <squashlib/squash/SquashHeader.hpp>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace sqh
+{
+
+// Accumulates the output in a large aligned buffer which is handed to the back end in big chunks, so that a block
+// costs a few memcpy instead of up to three stream writes. The back end is a std::ofstream, a byte vector (for encoding
+// in memory) or, when built with SQH_POSIX_IO, a file descriptor written with pwrite().
+class BlockWriter
+{
+public:
+	static constexpr size_t DEFAULT_CAPACITY = 1 << 20;
+	static constexpr size_t BUFFER_ALIGNMENT = 4096;
+
+	explicit BlockWriter(std::ofstream& output_file, size_t capacity = DEFAULT_CAPACITY);
+	// appends to output
+	explicit BlockWriter(std::vector<uint8_t>& output, size_t capacity = DEFAULT_CAPACITY);
+#if defined(SQH_POSIX_IO)
+	// writes at offset in the file (the descriptor is not closed by the writer)
+	BlockWriter(int file_descriptor, uint64_t offset, size_t capacity = DEFAULT_CAPACITY);
+#endif
+	~BlockWriter();
+
+	// prevent copying
+	BlockWriter(const BlockWriter& other)            = delete;
+	BlockWriter& operator=(const BlockWriter& other) = delete;
+
+	void write(const void* data, size_t size);
+
+	// writes the info byte, the table (for long blocks) and the data of the block
+	void writeBlock(const CompressedBlock& block);
+
+	// hands the buffered bytes to the back end, returns false if any write failed so far
+	bool flush();
+	bool good() const;
+
+	// bytes written so far, including the ones still in the buffer
+	uint64_t size() const;
+
+private:
+	static constexpr size_t MAX_BLOCK_SIZE = sizeof(uint8_t) + sizeof(uint64_t) + BLOCK_SIZE * BLOCK_SIZE;
+
+	void write_out(const uint8_t* data, size_t size);
+
+	std::ofstream*        m_stream = nullptr;
+	std::vector<uint8_t>* m_memory = nullptr;
+	int            m_fileDescriptor = -1;
+	uint64_t       m_offset = 0;
+
+	uint8_t* m_buffer = nullptr;
+	size_t   m_capacity = 0;
+	size_t   m_size = 0;
+	uint64_t m_flushed = 0;
+	bool     m_good = true;
+};
+
+inline void BlockWriter::writeBlock(const CompressedBlock& block)
+{
+	if (m_capacity - m_size < MAX_BLOCK_SIZE)
+		flush();
+
+	// there is always room for the largest block, so the table and the data are copied with their full size (which the
+	// compiler turns into a few vector moves) and only the cursor advances by their real length
+	const size_t isLong = (block.infoByte >> 6) & 1;
+	static_assert(static_cast<uint8_t>(InfoByte::IsLong) == (1 << 6), "writeBlock expects IsLong to be bit 6.");
+
+	uint8_t* output = m_buffer + m_size;
+	*output++ = block.infoByte;
+	std::memcpy(output, &block.table, sizeof(block.table));
+	output += isLong * sizeof(block.table);
+	std::memcpy(output, block.data, sizeof(block.data));
+	output += block.dataCount;
+
+	m_size = static_cast<size_t>(output - m_buffer);
+}
+
+} // namespace sqh
+
+#endif // INCLUDE_SQH_BLOCK_WRITER_HPP
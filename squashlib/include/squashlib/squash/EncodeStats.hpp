@@ -0,0 +1,43 @@
+/**
+ * @file EncodeStats.hpp
+ * @author Eliot Fondere
+ * @brief Statistics collected while encoding a squash file
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_ENCODE_STATS_HPP
+#define INCLUDE_SQH_ENCODE_STATS_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace sqh
+{
+
+struct EncodeStats
+{
+	// how the blocks were stored
+	uint64_t dctBlocks = 0;
+	uint64_t haarBlocks = 0;
+	uint64_t shortBlocks = 0;
+	uint64_t longBlocks = 0;
+
+	// bytes of block data for each channel (info bytes and tables included), and of the whole file
+	std::array<uint64_t, 3> channelBytes{};
+	uint64_t totalBytes = 0;
+
+	// average of the compression quality of the chosen blocks, to compare to the requested quality
+	double averageQuality = 0.0;
+	double requestedQuality = 0.0;
+
+	// time spent in each stage, in milliseconds
+	double optimizeTime = 0.0; // quantization table search
+	double blocksTime = 0.0;   // transforming, choosing and packing the blocks
+	double flushTime = 0.0;    // writing out what is left in the buffer
+};
+
+} // namespace sqh
+
+#endif // INCLUDE_SQH_ENCODE_STATS_HPP
@@ -0,0 +1,58 @@
+/**
+ * @file EncoderOptions.hpp
+ * @author Eliot Fondere
+ * @brief Settings of a single encode, passed to every call that writes a squash file
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_ENCODER_OPTIONS_HPP
+#define INCLUDE_SQH_ENCODER_OPTIONS_HPP
+
+#include <squashlib/squash/EncodeStats.hpp>
+
+namespace sqh
+{
+
+// which transform each block may use
+enum class TransformPolicy
+{
+	Best,     // the one whose compression quality is the closest to the requested quality
+	DctOnly,
+	HaarOnly,
+};
+
+struct EncoderOptions
+{
+	// requested compression quality of the blocks, used to choose between the DCT and the Haar transform
+	double quality = 0.5;
+	TransformPolicy transform = TransformPolicy::Best;
+
+	// tunes the DCT quantization table for the quality on a sample of the blocks before encoding, the Haar table is kept
+	// as it is (the tables are stored in the file, decoders need nothing more)
+	bool optimizeQTables = false;
+
+	// threads encoding bands of blocks, 0 uses every hardware thread. The output does not depend on it
+	unsigned int threads = 1;
+
+	// 0 writes the blocks in a single sequence. Otherwise the image is split in tiles of tileSize x tileSize pixels (a
+	// multiple of BLOCK_SIZE), each of which can be decoded on its own with SquashImage::decodeRegion()
+	uint32_t tileSize = 0;
+
+	// stores the coefficients by frequency band instead of by block: the DC coefficient of every block first, then the
+	// low frequencies, then the high ones, so that the start of the file already decodes to a preview of the image. The
+	// decoded image is the same. Cannot be combined with tiles nor used by SquashImage::encodeLadder()
+	bool progressive = false;
+
+	// resolution levels saved by encode() and save_sqh(): the image, then successive 2x downscales of it (down to a
+	// single pixel at most), each a complete squash file indexed in the pyramid's header. 1 saves the image alone, which
+	// is also what estimateSize() sizes. encodeToSize() and encodeLadder() fail with more than 1 level
+	unsigned int pyramidLevels = 1;
+
+	// filled with the statistics of the encode, if given
+	EncodeStats* stats = nullptr;
+};
+
+} // namespace sqh
+
+#endif // INCLUDE_SQH_ENCODER_OPTIONS_HPP
@@ -0,0 +1,39 @@
+/**
+ * @file QTableProfile.hpp
+ * @author Eliot Fondere
+ * @brief Quantization tables trained on a corpus of images, shared between encodes through a small file
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_QTABLE_PROFILE_HPP
+#define INCLUDE_SQH_QTABLE_PROFILE_HPP
+
+#include <squashlib/squash/SquashHeader.hpp>
+#include <squashlib/math/Matrix.hpp>
+#include <string_view>
+
+namespace sqh
+{
+
+// magic number of profile files, followed by the quality, the image count and both tables (raster order, as in a
+// squash file)
+constexpr uint32_t PROFILE_MAGIC_NUMBER = 0x2F737174;
+
+struct QTableProfile
+{
+	// only the DCT table is trained, the Haar table is the default one (stored so that it can be changed by hand)
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> dctTable;
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> haarTable;
+
+	// what the tables were trained for, and on
+	double   quality = 0.0;
+	uint32_t images = 0;
+
+	bool open(std::string_view file_path);
+	bool save(std::string_view file_path) const;
+};
+
+} // namespace sqh
+
+#endif // INCLUDE_SQH_QTABLE_PROFILE_HPP
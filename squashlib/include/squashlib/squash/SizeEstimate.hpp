@@ -0,0 +1,30 @@
+/**
+ * @file SizeEstimate.hpp
+ * @author Eliot Fondere
+ * @brief Size of a squash file, computed without encoding it
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_SIZE_ESTIMATE_HPP
+#define INCLUDE_SQH_SIZE_ESTIMATE_HPP
+
+#include <cstdint>
+
+namespace sqh
+{
+
+struct SizeEstimate
+{
+	// size of the whole file, in bytes
+	uint64_t bytes = 0;
+	// the actual size is within bytes +- errorBound with a confidence of about 95%, 0 when every block was sized
+	uint64_t errorBound = 0;
+
+	uint64_t sampledBlocks = 0;
+	uint64_t totalBlocks = 0;
+};
+
+} // namespace sqh
+
+#endif // INCLUDE_SQH_SIZE_ESTIMATE_HPP
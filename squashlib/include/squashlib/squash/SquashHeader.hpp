@@ -9,6 +9,7 @@
 #ifndef INCLUDE_SQH_SQUASH_HEADER_HPP
 #define INCLUDE_SQH_SQUASH_HEADER_HPP
 
+#include <cstddef>
 #include <cstdint>
 
 namespace sqh
@@ -16,6 +17,12 @@ namespace sqh
 
 constexpr size_t BLOCK_SIZE = 8;
 constexpr uint32_t MAGIC_NUMBER = 0x2F737168;
+// files split in independently decodable tiles, see EncoderOptions::tileSize
+constexpr uint32_t TILED_MAGIC_NUMBER = 0x2F737169;
+// files holding a resolution pyramid, see EncoderOptions::pyramidLevels
+constexpr uint32_t PYRAMID_MAGIC_NUMBER = 0x2F737170;
+// files whose blocks are ordered by frequency band, see EncoderOptions::progressive
+constexpr uint32_t PROGRESSIVE_MAGIC_NUMBER = 0x2F737167;
 
 enum class ImageChannels: uint8_t
 {
@@ -10,18 +10,39 @@
 #define INCLUDE_SQH_SQUASH_IMAGE_HPP
 
 #include <squashlib/squash/SquashHeader.hpp>
+#include <squashlib/squash/BlockWriter.hpp>
+#include <squashlib/squash/EncodeStats.hpp>
+#include <squashlib/squash/EncoderOptions.hpp>
+#include <squashlib/squash/QTableProfile.hpp>
+#include <squashlib/squash/SizeEstimate.hpp>
 #include <squashlib/math/Matrix.hpp>
 #include <array>
+#include <fstream>
+#include <istream>
+#include <list>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace sqh
 {
 
+// a block transformation matrix with its transpose, so that neither has to be computed per block
+struct BlockTransform
+{
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> matrix;
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> transposed;
+};
+
 class SquashImage
 {
 public:
-	static double Quality;
+	// decoded blocks openLazy() keeps by default
+	static constexpr size_t DEFAULT_CACHE_BYTES = 4 << 20;
 
+	// an empty image, to be filled with open() or decode()
+	SquashImage();
 	explicit SquashImage(std::string_view file_path);
 	~SquashImage();
 
@@ -30,13 +51,63 @@ public:
 	SquashImage& operator=(const SquashImage& other) = delete;
 
 	bool open(std::string_view file_path);
-	bool save(std::string_view file_path, bool overwrite);
+	// options are only used when saving a squash file
+	bool save(std::string_view file_path, bool overwrite, const EncoderOptions& options = {});
 
 	bool open_png(std::string_view file_path);
 	bool save_png(std::string_view file_path, bool overwrite=false);
 
-	bool open_sqh(std::string_view file_path);
-	bool save_sqh(std::string_view file_path, bool overwrite=false);
+	// scale is only used with resolution pyramids (see EncoderOptions::pyramidLevels): the level whose width over the
+	// image's is the closest to scale is decoded. Files without a pyramid only have the image, at scale 1
+	bool open_sqh(std::string_view file_path, float scale = 1.f);
+	bool save_sqh(std::string_view file_path, bool overwrite=false, const EncoderOptions& options = {}) const;
+
+	// same as save_sqh / open_sqh, but to and from a buffer in memory. Encoding only reads the image, so one image can
+	// be encoded by several threads at once (with different options), as long as nothing modifies it meanwhile
+	bool encode(std::vector<uint8_t>& output, const EncoderOptions& options = {}) const;
+	// input may only hold the start of a progressive file (see EncoderOptions::progressive), whose passes are then
+	// decoded as far as they go
+	bool decode(const std::vector<uint8_t>& input, float scale = 1.f);
+
+	// encodes the image once per scale of its quantization tables (see scaleQTable()), outputs[k] gets the file at
+	// scales[k] and is the same as an encode() with the scaled tables. The forward transforms are only computed once
+	// per block for all of them. stats (if given) gets the statistics of every output, options.stats is not used.
+	// Fails without encoding anything for progressive files and pyramids, which are written one scale at a time
+	bool encodeLadder(const std::vector<float>& scales, std::vector<std::vector<uint8_t>>& outputs,
+	                  const EncoderOptions& options = {}, std::vector<EncodeStats>* stats = nullptr) const;
+
+	// encodes with both tables scaled (see scaleQTable()) by the smallest scale, that is the best quality, whose file
+	// fits in target_bytes. The scales are sized on cached transforms (of a sample of the blocks on large images, whose
+	// result is then checked on every block), options.threads of them at a time, and the image is encoded once, at the
+	// chosen scale. A budget the unscaled tables fit gives a scale of at most 1, down to where the quantized
+	// coefficients would leave int8_t. Fails if the file does not fit even with the coarsest tables, and for pyramids
+	bool encodeToSize(std::vector<uint8_t>& output, uint64_t target_bytes, const EncoderOptions& options = {},
+	                  float* chosen_scale = nullptr) const;
+
+	// size of the file encode() would write with these options, without packing or writing any block. With a
+	// sample_fraction below 1, only that fraction of the block positions (spread over the image) is sized and the
+	// size is extrapolated, with an error bound
+	SizeEstimate estimateSize(const EncoderOptions& options = {}, double sample_fraction = 1.0) const;
+
+	// reads the header, the tables and the tile index of a file saved with a tile size, and keeps the file open for
+	// decodeRegion() without decoding any pixel. A file without tiles is read as a single tile. In a pyramid, the level
+	// closest to scale is opened (see open_sqh())
+	bool openTiles(std::string_view file_path, float scale = 1.f);
+	// decodes the pixels [x, x + width) x [y, y + height) of the file opened by openTiles() into output, as RGB rows of
+	// output_stride bytes (0 for 3 * width). Only the tiles the region intersects are read
+	bool decodeRegion(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t* output,
+	                  size_t output_stride = 0);
+
+	// reads the header of a squash file and the offsets of its blocks (without decoding them), and keeps the file open:
+	// getPixel() and getRow() then decode the blocks they need, keeping the last ones used in a cache of at most
+	// cache_bytes. In a pyramid, the level closest to scale is opened (see open_sqh()). Progressive files store the
+	// coefficients of a block apart from each other and cannot be opened lazily
+	bool openLazy(std::string_view file_path, size_t cache_bytes = DEFAULT_CACHE_BYTES, float scale = 1.f);
+
+	// RGB value of a pixel, or row y (3 * width bytes), of an image decoded or opened lazily. These are not thread safe
+	// on a lazy image, whose cache they update
+	bool getPixel(uint32_t x, uint32_t y, uint8_t* rgb);
+	bool getRow(uint32_t y, uint8_t* output);
 
 	uint8_t* getData();
 	const SquashHeader& getHeader();
@@ -44,48 +115,228 @@ public:
 	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& getDCTQTable() const;
 	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& getHaarQTable() const;
 
+	// replaces both quantization tables (and the reciprocals used by the quantizer)
+	void setQTables(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& dct_table,
+	                const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& haar_table);
+
+	// replaces both quantization tables with the ones of a profile written by squashtrain
+	bool loadQTables(std::string_view profile_path);
+
 	void free();
 
+	// table * scale, rounded to what a squash file stores (an integer from 1 to 255)
+	static math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> scaleQTable(
+		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& table, float scale);
+
+	// tunes the default DCT table for options.quality, as findOptimalQTables() does for one image, on blocks sampled
+	// from every image (loaded on options.threads threads). The profile's Haar table is the default one. Images that
+	// cannot be opened are skipped
+	static bool trainQTables(const std::vector<std::string>& image_paths, const EncoderOptions& options,
+	                         QTableProfile& profile);
+
 private:
+	// quantization tables of one of the files written by compress()
+	struct EncodeLevel
+	{
+		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> dctTable;
+		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> haarTable;
+		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> dctReciprocal;
+		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> haarReciprocal;
+	};
+
+	// blocks [firstRow, endRow) x [firstColumn, endColumn): a band of rows or a tile
+	struct BlockRange
+	{
+		uint32_t firstRow;
+		uint32_t endRow;
+		uint32_t firstColumn;
+		uint32_t endColumn;
+	};
+
+	// where decompress_blocks() writes the pixels [x0, x1) x [y0, y1) of the image, pixel (x0, y0) being data[0]
+	struct RegionOutput
+	{
+		uint8_t* data;
+		size_t   stride;
+		uint32_t x0;
+		uint32_t y0;
+		uint32_t x1;
+		uint32_t y1;
+	};
+
+	// blocks of the file opened by openLazy() are read by groups of consecutive block positions of a row, which never
+	// span two tiles (a whole row of blocks is a single tile in files without tiles)
+	struct LazyGroup
+	{
+		size_t   index;
+		uint32_t firstColumn;
+		uint32_t endColumn;
+	};
+
+	// lets squashbench call the block kernels directly
+	friend struct KernelAccess;
+
+	// the transforms used by compress() and decompress()
+	static const BlockTransform& dct_transform();
+	static const BlockTransform& haar_transform();
+
 	static math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t> transform_block(
 		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& block,
-		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& transform_matrix,
-		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& quantization_matrix,
+		const BlockTransform& transform,
+		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& quantization_reciprocal,
 		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>* coefficients = nullptr);
 
 	static math::Matrix<8, 8, uint8_t> inverse_transform_block(
-		std::ifstream& input_file, uint8_t info_byte,
-		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& transform_matrix,
+		std::istream& input_file, uint8_t info_byte,
+		const BlockTransform& transform,
 		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& quantization_matrix);
 
+	// coefficient_count: how many leading zig-zag coefficients may be non-zero, fewer allow a cheaper transform
 	static math::Matrix<8, 8, uint8_t> test_inverse_transform_block(
 		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>& input_block,
-		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& transform_matrix,
-		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& quantization_matrix);
+		const BlockTransform& transform,
+		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& quantization_matrix,
+		size_t coefficient_count = BLOCK_SIZE * BLOCK_SIZE);
 
 	static void compress_block(
 		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>& block_data, CompressedBlock& compressed_block,
 		bool isHaar);
 	static math::Matrix<8, 8, int8_t> decompress_block(
-		std::ifstream& input_file, uint8_t infoByte);
+		std::istream& input_file, uint8_t infoByte);
+	// name of the code path compress_block packs with on this CPU (SSSE3 or scalar)
+	static const char* packing_path();
+
+	// reads the magic number, the header and the quantization tables
+	bool read_preamble(std::istream& input_file, std::string_view source_name, uint32_t& magic_number);
+	bool read_sqh(std::istream& input_file, std::string_view source_name, float scale);
+	// reads the index of a pyramid whose header was just read, and seeks to the level closest to scale
+	bool seek_pyramid_level(std::istream& input_file, float scale);
+	// writes one file per level, stats gets one entry per level
+	bool write_sqh(const std::vector<BlockWriter*>& outputs, const std::vector<EncodeLevel>& levels,
+	               const EncoderOptions& options, std::vector<EncodeStats>& stats) const;
+	bool write_sqh(BlockWriter& output, const EncoderOptions& options) const;
+	bool write_sqh(BlockWriter& output, const EncodeLevel& level, const EncoderOptions& options,
+	               double optimize_time) const;
+	// writes options.pyramidLevels levels, each encoded with the tables of level
+	bool write_pyramid(BlockWriter& output, const EncodeLevel& level, const EncoderOptions& options,
+	                   double optimize_time) const;
+
+	// reorders the blocks of a sequential file, encoded in memory, by frequency band
+	bool write_progressive(BlockWriter& output, const std::vector<uint8_t>& sequential) const;
+
+	// fills output with this image downscaled 2x (rounding up)
+	bool half_size(SquashImage& output) const;
+
+	// opens m_sourceFile and reads its preamble, or the preamble of the level closest to scale in a pyramid, which
+	// starts at level_start. Progressive files are refused: the coefficients of a block are not stored together
+	bool open_source(std::string_view file_path, float scale, uint32_t& magic_number, uint64_t& level_start);
+
+	// the tiles of tile_size pixels, in raster order (a single range for the whole image with a tile size of 0)
+	std::vector<BlockRange> tile_ranges(uint32_t tile_size) const;
 
-	bool decompress(std::ifstream& input_file);
-	bool compress(std::ofstream& output_file);
+	bool decompress(std::istream& input_file);
+	bool decompress_tiles(std::istream& input_file);
+	bool decompress_progressive(std::istream& input_file);
+	// reads the blocks of range, stored in this order, and writes the pixels that fall in output. The other blocks are
+	// only skipped over
+	void decompress_blocks(std::istream& input_file, const BlockRange& range, const RegionOutput& output) const;
+	// writes the pixels of block (block_y, block_x) of channel which fall in output
+	static void store_block(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& f_bar, uint32_t block_y,
+	                        uint32_t block_x, size_t channel, const RegionOutput& output);
+
+	// the group holding block (block_y, block_x)
+	LazyGroup lazy_group(uint32_t block_y, uint32_t block_x) const;
+	// decoded pixels of the group, as BLOCK_SIZE RGB rows of 3 * BLOCK_SIZE * LAZY_GROUP_BLOCKS bytes. Decodes it on a
+	// cache miss, in the place of the least recently used group
+	const uint8_t* cached_group(uint32_t block_y, const LazyGroup& group);
+
+	bool compress(const std::vector<BlockWriter*>& outputs, const std::vector<EncodeLevel>& levels,
+	              const EncoderOptions& options, std::vector<EncodeStats>& stats) const;
+	// encodes the blocks of range at every level, stats points to one entry per level and their averageQuality gets the
+	// sum of the block qualities
+	void compress_blocks(const BlockRange& range, const std::vector<BlockWriter*>& outputs,
+	                     const std::vector<EncodeLevel>& levels, const EncoderOptions& options, EncodeStats* stats) const;
+
+	// quantizes and packs the block with the transforms options allow, and keeps the one closest to options.quality
+	static void encode_block(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& block,
+	                         const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& dct_coefficients,
+	                         const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& haar_coefficients,
+	                         const EncodeLevel& tables, const EncoderOptions& options,
+	                         CompressedBlock& best_block, double& best_quality);
 
 	static size_t getCompressedSize(CompressedBlock& compressed_block);
+	// bytes the block takes in a file written with options
+	static size_t stored_size(CompressedBlock& compressed_block, const EncoderOptions& options);
 
 	static double computeCompressionQuality(
 		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& original,
 		const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& compressed,
 		size_t compressedSize);
 
-	void findOptimalQTables();
+	// bytes before the first block: magic number, header, tables and tile or pass index
+	uint64_t preamble_size(const EncoderOptions& options) const;
+
+	// the tables the encoder starts from: the image's, tuned when options ask for it
+	EncodeLevel base_level(const EncoderOptions& options) const;
+
+	static EncodeLevel make_level(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& dct_table,
+	                              const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& haar_table);
+
+	// start with its DCT table tuned for options.quality, on a sample of the blocks. The Haar table is kept as it is
+	EncodeLevel findOptimalQTables(const EncodeLevel& start, const EncoderOptions& options) const;
+
+	struct OptimizationSample;
+
+	// appends up to max_samples blocks, spread over the whole image, with their transforms
+	void collect_samples(size_t max_samples, unsigned int thread_count, std::vector<OptimizationSample>& samples) const;
+	static EncodeLevel tune_qtables(const std::vector<OptimizationSample>& samples, const EncodeLevel& start,
+	                                double quality, unsigned int thread_count);
+
+	// bytes of the blocks encoded with tables, without packing or writing anything
+	static uint64_t estimate_size(const std::vector<OptimizationSample>& blocks, const EncodeLevel& tables,
+	                              const EncoderOptions& options, unsigned int thread_count);
+	// smallest scale of the tables of base (at least MIN_RATE_SCALE) with which no coefficient of the blocks leaves
+	// int8_t once quantized
+	static float fitting_scale(const std::vector<OptimizationSample>& blocks, const EncodeLevel& base);
+	// the same for every block of the image, transformed on the fly
+	uint64_t image_size(const EncodeLevel& tables, const EncoderOptions& options, unsigned int thread_count) const;
+
+	// copies the interleaved RGB data into per-channel planes padded to a multiple of BLOCK_SIZE, on the first call after
+	// the image is loaded: only encoding reads them, and decoded images do not pay for them
+	void build_planes() const;
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> load_block(uint32_t block_y, uint32_t block_x, size_t channel) const;
 
 	SquashHeader m_header{};
 	uint8_t*     m_data = nullptr;
 
+	// planar copy of m_data used by the encoder (channel-major, padded with 128), built by the first encode
+	mutable std::mutex m_planesMutex;
+	mutable std::vector<uint8_t> m_planes;
+	mutable size_t m_planeStride = 0;
+	mutable size_t m_planeRows   = 0;
+
 	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> m_dctQTable;
 	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> m_haarQTable;
+
+	// element-wise 1 / Q, kept in sync by setQTables() so that quantizing is a multiplication
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> m_dctQReciprocal;
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> m_haarQReciprocal;
+
+	// file opened by openTiles() or openLazy()
+	std::ifstream m_sourceFile;
+
+	// tile size in pixels and the offset of every tile (in raster order) of the file opened by openTiles()
+	uint32_t m_tileSize = 0;
+	std::vector<uint64_t> m_tileOffsets;
+
+	// width in blocks of the tiles of the file opened by openLazy(), and the offset of every group
+	uint32_t m_lazyTileBlocks = 0;
+	std::vector<uint64_t> m_groupOffsets;
+
+	// least recently used group last, with their pixels
+	std::list<std::pair<size_t, std::vector<uint8_t>>> m_groupCache;
+	std::unordered_map<size_t, std::list<std::pair<size_t, std::vector<uint8_t>>>::iterator> m_groupCacheIndex;
+	size_t m_groupCacheCapacity = 0;
 };
 
 } // sqh
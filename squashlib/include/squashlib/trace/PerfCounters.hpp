@@ -0,0 +1,72 @@
+/**
+ * @file PerfCounters.hpp
+ * @author Eliot Fondere
+ * @brief Hardware performance counters of the calling thread, read with perf_event_open on Linux
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_PERF_COUNTERS_HPP
+#define INCLUDE_SQH_PERF_COUNTERS_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace sqh::trace
+{
+
+// counts are 0 when the counter is not available
+struct CounterValues
+{
+	uint64_t cycles = 0;
+	uint64_t instructions = 0;
+	uint64_t cacheMisses = 0;
+	uint64_t branchMisses = 0;
+
+	double ipc() const
+	{
+		return cycles == 0 ? 0.0 : static_cast<double>(instructions) / static_cast<double>(cycles);
+	}
+
+	CounterValues& operator+=(const CounterValues& other)
+	{
+		cycles += other.cycles;
+		instructions += other.instructions;
+		cacheMisses += other.cacheMisses;
+		branchMisses += other.branchMisses;
+		return *this;
+	}
+};
+
+// Counts user space cycles, instructions, last level cache misses and branch misses of the thread that created it, and
+// of the threads it starts afterwards (such as the workers of a multithreaded encode). The counters form a single group,
+// enabled, disabled and read together, so that they all cover the same instructions. Counters the CPU, the kernel or
+// its permissions (perf_event_paranoid) do not allow are left out, and none are available outside of Linux. When the
+// kernel has to multiplex the group, the counts are scaled to the whole measurement.
+class PerfCounters
+{
+public:
+	PerfCounters();
+	~PerfCounters();
+
+	// prevent copying
+	PerfCounters(const PerfCounters& other)            = delete;
+	PerfCounters& operator=(const PerfCounters& other) = delete;
+
+	// true if at least one counter could be opened
+	bool available() const;
+
+	void start();
+	CounterValues stop();
+
+private:
+	static constexpr size_t COUNTER_COUNT = 4;
+
+	std::array<int, COUNTER_COUNT> m_fileDescriptors{};
+	int m_groupLeader = -1;
+};
+
+} // namespace sqh::trace
+
+#endif // INCLUDE_SQH_PERF_COUNTERS_HPP
@@ -0,0 +1,71 @@
+/**
+ * @file Trace.hpp
+ * @author Eliot Fondere
+ * @brief Timeline spans recorded in per-thread ring buffers and exported as Chrome trace JSON
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_TRACE_HPP
+#define INCLUDE_SQH_TRACE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+namespace sqh::trace
+{
+
+#if defined(SQH_TRACING)
+constexpr bool ENABLED = true;
+#else
+constexpr bool ENABLED = false;
+#endif
+
+// events kept per thread, older ones are overwritten
+constexpr size_t RING_CAPACITY = 1 << 16;
+
+// nanoseconds since the first call
+uint64_t now();
+
+// name must outlive the trace (in practice, a string literal)
+void record(const char* name, uint64_t start, uint64_t end);
+
+// records the time between its construction and its destruction
+class Span
+{
+public:
+	explicit Span(const char* name) : m_name(name), m_start(now()) {}
+	~Span() { record(m_name, m_start, now()); }
+
+	// prevent copying
+	Span(const Span& other)            = delete;
+	Span& operator=(const Span& other) = delete;
+
+private:
+	const char* m_name;
+	uint64_t    m_start;
+};
+
+// writes the events of every thread in the Chrome trace format (chrome://tracing or ui.perfetto.dev). This should be
+// called once the traced work is done, events recorded while it runs may or may not be included.
+void writeChromeTrace(std::ostream& output);
+bool saveChromeTrace(std::string_view file_path);
+
+// drops all recorded events, must not run while traced work is running
+void clear();
+
+} // namespace sqh::trace
+
+#define SQH_TRACE_CONCAT_IMPL(a, b) a##b
+#define SQH_TRACE_CONCAT(a, b) SQH_TRACE_CONCAT_IMPL(a, b)
+
+// traces the rest of the enclosing scope, compiles to nothing unless SQH_TRACING is defined
+#if defined(SQH_TRACING)
+#define SQH_TRACE_SCOPE(name) ::sqh::trace::Span SQH_TRACE_CONCAT(sqh_trace_span_, __LINE__)(name)
+#else
+#define SQH_TRACE_SCOPE(name) ((void)0)
+#endif
+
+#endif // INCLUDE_SQH_TRACE_HPP
@@ -0,0 +1,56 @@
+/**
+ * @file Parallel.hpp
+ * @author Eliot Fondere
+ * @brief Minimal worker pool used to process independent items (files, bands of blocks) in parallel
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_PARALLEL_HPP
+#define INCLUDE_SQH_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace sqh
+{
+
+// calls function(k) for every k < count on thread_count threads, every worker takes the next k until none are left.
+// With a single thread (or a single item), everything runs on the calling thread
+template<typename F>
+void for_each_parallel(size_t count, unsigned int thread_count, F&& function)
+{
+	if (thread_count <= 1 || count <= 1)
+	{
+		for (size_t k = 0; k < count; k++)
+		{
+			function(k);
+		}
+		return;
+	}
+
+	std::atomic<size_t> next = 0;
+
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < std::min<size_t>(thread_count, count); t++)
+	{
+		workers.emplace_back([&] {
+			for (size_t k = next++; k < count; k = next++)
+			{
+				function(k);
+			}
+		});
+	}
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+} // namespace sqh
+
+#endif // INCLUDE_SQH_PARALLEL_HPP
@@ -0,0 +1,138 @@
+/**
+ * @file BlockWriter.cpp
+ * @author Eliot Fondere
+ * @brief Implementation of BlockWriter.hpp
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include <squashlib/squash/BlockWriter.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <new>
+
+#if defined(SQH_POSIX_IO)
+#include <unistd.h>
+#endif
+
+namespace sqh
+{
+
+BlockWriter::BlockWriter(std::ofstream& output_file, size_t capacity)
+	: m_stream(&output_file)
+	, m_capacity(std::max(capacity, MAX_BLOCK_SIZE))
+{
+	m_buffer = static_cast<uint8_t*>(::operator new(m_capacity, std::align_val_t(BUFFER_ALIGNMENT)));
+}
+
+BlockWriter::BlockWriter(std::vector<uint8_t>& output, size_t capacity)
+	: m_memory(&output)
+	, m_capacity(std::max(capacity, MAX_BLOCK_SIZE))
+{
+	m_buffer = static_cast<uint8_t*>(::operator new(m_capacity, std::align_val_t(BUFFER_ALIGNMENT)));
+}
+
+#if defined(SQH_POSIX_IO)
+BlockWriter::BlockWriter(int file_descriptor, uint64_t offset, size_t capacity)
+	: m_fileDescriptor(file_descriptor)
+	, m_offset(offset)
+	, m_capacity(std::max(capacity, MAX_BLOCK_SIZE))
+{
+	m_buffer = static_cast<uint8_t*>(::operator new(m_capacity, std::align_val_t(BUFFER_ALIGNMENT)));
+}
+#endif
+
+BlockWriter::~BlockWriter()
+{
+	flush();
+	::operator delete(m_buffer, std::align_val_t(BUFFER_ALIGNMENT));
+}
+
+void BlockWriter::write(const void* data, size_t size)
+{
+	auto input = static_cast<const uint8_t*>(data);
+
+	if (size >= m_capacity)
+	{
+		// too big to be worth copying
+		flush();
+		write_out(input, size);
+		return;
+	}
+
+	if (m_capacity - m_size < size)
+		flush();
+
+	std::memcpy(m_buffer + m_size, input, size);
+	m_size += size;
+}
+
+bool BlockWriter::flush()
+{
+	if (m_size > 0)
+	{
+		write_out(m_buffer, m_size);
+		m_size = 0;
+	}
+
+	return m_good;
+}
+
+bool BlockWriter::good() const
+{
+	return m_good;
+}
+
+uint64_t BlockWriter::size() const
+{
+	return m_flushed + m_size;
+}
+
+void BlockWriter::write_out(const uint8_t* data, size_t size)
+{
+	m_flushed += size;
+
+	if (!m_good)
+		return;
+
+	if (m_memory != nullptr)
+	{
+		m_memory->insert(m_memory->end(), data, data + size);
+		return;
+	}
+
+#if defined(SQH_POSIX_IO)
+	if (m_stream == nullptr)
+	{
+		while (size > 0)
+		{
+			ssize_t written = ::pwrite(m_fileDescriptor, data, size, static_cast<off_t>(m_offset));
+			if (written < 0 && errno == EINTR)
+				continue;
+
+			if (written <= 0)
+			{
+				std::cout << "[ERROR] (BlockWriter): pwrite failed with errno " << errno << std::endl;
+				m_good = false;
+				return;
+			}
+
+			data += written;
+			size -= static_cast<size_t>(written);
+			m_offset += static_cast<uint64_t>(written);
+		}
+
+		return;
+	}
+#endif
+
+	m_stream->write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+	if (!m_stream->good())
+	{
+		std::cout << "[ERROR] (BlockWriter): Failed to write to the output file" << std::endl;
+		m_good = false;
+	}
+}
+
+} // namespace sqh
@@ -0,0 +1,78 @@
+/**
+ * @file QTableProfile.cpp
+ * @author Eliot Fondere
+ * @brief Implementation of QTableProfile.hpp
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include <squashlib/squash/QTableProfile.hpp>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace sqh
+{
+
+namespace
+{
+
+constexpr auto raster_indices = math::raster_order<BLOCK_SIZE, BLOCK_SIZE>();
+
+} // namespace
+
+bool QTableProfile::open(std::string_view file_path)
+{
+	std::ifstream input_file(std::string(file_path), std::ios::binary);
+
+	uint32_t magic_number = 0;
+	input_file.read(reinterpret_cast<char*>(&magic_number), sizeof(uint32_t));
+
+	if (magic_number != PROFILE_MAGIC_NUMBER)
+	{
+		std::cout << "[ERROR] (QTableProfile): File \"" << file_path << "\" is not a quantization table profile"
+		          << std::endl;
+		return false;
+	}
+
+	input_file.read(reinterpret_cast<char*>(&quality), sizeof(double));
+	input_file.read(reinterpret_cast<char*>(&images), sizeof(uint32_t));
+
+	uint8_t q_data[BLOCK_SIZE][BLOCK_SIZE] = {};
+	input_file.read(reinterpret_cast<char*>(q_data), sizeof(uint8_t) * BLOCK_SIZE * BLOCK_SIZE);
+	dctTable = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>::FromArray(q_data).asType<float>();
+	input_file.read(reinterpret_cast<char*>(q_data), sizeof(uint8_t) * BLOCK_SIZE * BLOCK_SIZE);
+	haarTable = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>::FromArray(q_data).asType<float>();
+
+	if (!input_file)
+	{
+		std::cout << "[ERROR] (QTableProfile): File \"" << file_path << "\" is truncated" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool QTableProfile::save(std::string_view file_path) const
+{
+	std::ofstream output_file(std::string(file_path), std::ios::binary);
+	if (!output_file)
+	{
+		std::cout << "[ERROR] (QTableProfile): Could not open file for writing: " << file_path << std::endl;
+		return false;
+	}
+
+	auto dct_data = dctTable.asType<uint8_t>().flatten<raster_indices>();
+	auto haar_data = haarTable.asType<uint8_t>().flatten<raster_indices>();
+
+	output_file.write(reinterpret_cast<const char*>(&PROFILE_MAGIC_NUMBER), sizeof(uint32_t));
+	output_file.write(reinterpret_cast<const char*>(&quality), sizeof(double));
+	output_file.write(reinterpret_cast<const char*>(&images), sizeof(uint32_t));
+	output_file.write(reinterpret_cast<const char*>(dct_data.data()), BLOCK_SIZE * BLOCK_SIZE);
+	output_file.write(reinterpret_cast<const char*>(haar_data.data()), BLOCK_SIZE * BLOCK_SIZE);
+
+	return static_cast<bool>(output_file);
+}
+
+} // namespace sqh
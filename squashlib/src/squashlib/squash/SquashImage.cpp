@@ -8,15 +8,59 @@
 
 #include <squashlib/squash/SquashImage.hpp>
 #include <squashlib/math/math.hpp>
+#include <squashlib/trace/Trace.hpp>
+#include <squashlib/util/Parallel.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include <stb/stb_image.h>
 #include <stb/stb_image_write.h>
-
+#include <stb/stb_image_resize.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(SQH_POSIX_IO)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SQH_SSE2
+#include <emmintrin.h>
+#endif
+
+// the pshufb kernels are always used when the build targets SSSE3. Otherwise, on x86 compilers that can build single
+// functions for it, they are compiled for SSSE3 on their own and chosen at run time when the CPU has it
+#if defined(__SSSE3__) || defined(__AVX__)
+#define SQH_SSSE3
+#define SQH_SSSE3_TARGET
+#include <tmmintrin.h>
+#elif defined(SQH_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define SQH_SSSE3
+#define SQH_SSSE3_DISPATCH
+#define SQH_SSSE3_TARGET __attribute__((target("ssse3")))
+#include <cpuid.h>
+#include <tmmintrin.h>
+#elif defined(SQH_SSE2) && defined(_MSC_VER)
+#define SQH_SSSE3
+#define SQH_SSSE3_DISPATCH
+#define SQH_SSSE3_TARGET
+#include <tmmintrin.h>
+#endif
+
+#include <bitset>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <streambuf>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -26,32 +70,34 @@ namespace sqh
 namespace
 {
 
+// All tables are computed at compile time: no static initialization is needed and the optimizer sees them as
+// constants. The float arithmetic mirrors the original runtime computation, so the values are identical.
+
 // --- DCT ---
 
 // returns 1 if i == 0 and sqrt(2) otherwise
-float delta_i(size_t i)
+constexpr float delta_i(size_t i)
 {
 	if (i == 0)
 		return 1.f;
 	else
-		return std::sqrt(2.f);
+		return math::constexpr_sqrt(2.f);
 }
 
 // gives the i, j entry of the C matrix for compression using DCT
-float c_ij(size_t N, size_t i, size_t j)
+constexpr float c_ij(size_t N, size_t i, size_t j)
 {
-	return (delta_i(i)/std::sqrt(static_cast<float>(N)))
-	       * std::cos((static_cast<float>(i * (2 * j + 1)) * math::pi) / static_cast<float>(2 * N) );
+	return (delta_i(i)/math::constexpr_sqrt(static_cast<float>(N)))
+	       * math::constexpr_cos((static_cast<float>(i * (2 * j + 1)) * math::pi) / static_cast<float>(2 * N) );
 }
 
 // transformation matrix with DCT coefficients
-const sqh::math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> T_dct =
-	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromFunction([](size_t i, size_t j) {
-		return c_ij(BLOCK_SIZE, i, j);
-	});
+constexpr auto T_dct = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromFunction([](size_t i, size_t j) {
+	return c_ij(BLOCK_SIZE, i, j);
+});
 
 // quantization table
-float Q_dct_data_default[8][8] =
+constexpr float Q_dct_data_default[8][8] =
 	{
 		{10.f, 16.f, 22.f, 28.f, 34.f, 40.f, 46.f, 52.f},
 		{16.f, 22.f, 28.f, 34.f, 40.f, 46.f, 52.f, 58.f},
@@ -63,24 +109,28 @@ float Q_dct_data_default[8][8] =
 		{52.f, 58.f, 64.f, 70.f, 76.f, 82.f, 88.f, 94.f}
 	};
 
-math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> Q_dct_default = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromArray(Q_dct_data_default);
+constexpr auto Q_dct_default = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromArray(Q_dct_data_default);
 
 
 // --- HAAR ---
 
-float T_haar_data[BLOCK_SIZE][BLOCK_SIZE] =
+constexpr float haar_a = 1.f/(2*math::constexpr_sqrt(2.f));
+constexpr float haar_b = 1.f/2;
+constexpr float haar_c = 1/math::constexpr_sqrt(2.f);
+
+constexpr float T_haar_data[BLOCK_SIZE][BLOCK_SIZE] =
 	{
-		{1.f/(2*std::sqrt(2.f)),  1.f/(2*std::sqrt(2.f)),  1.f/2,      0,  1/std::sqrt(2.f),             0,            0,            0},
-		{1.f/(2*std::sqrt(2.f)),  1.f/(2*std::sqrt(2.f)),  1.f/2,      0, -1/std::sqrt(2.f),             0,            0,            0},
-		{1.f/(2*std::sqrt(2.f)),  1.f/(2*std::sqrt(2.f)), -1.f/2,      0,             0,  1/std::sqrt(2.f),            0,            0},
-		{1.f/(2*std::sqrt(2.f)),  1.f/(2*std::sqrt(2.f)), -1.f/2,      0,             0, -1/std::sqrt(2.f),            0,            0},
-		{1.f/(2*std::sqrt(2.f)), -1.f/(2*std::sqrt(2.f)),      0,  1.f/2,             0,            0,  1/std::sqrt(2.f),            0},
-		{1.f/(2*std::sqrt(2.f)), -1.f/(2*std::sqrt(2.f)),      0,  1.f/2,             0,            0, -1/std::sqrt(2.f),            0},
-		{1.f/(2*std::sqrt(2.f)), -1.f/(2*std::sqrt(2.f)),      0, -1.f/2,             0,            0,            0,  1/std::sqrt(2.f)},
-		{1.f/(2*std::sqrt(2.f)), -1.f/(2*std::sqrt(2.f)),      0, -1.f/2,             0,            0,            0, -1/std::sqrt(2.f)}
+		{haar_a,  haar_a,  haar_b,       0,  haar_c,       0,       0,       0},
+		{haar_a,  haar_a,  haar_b,       0, -haar_c,       0,       0,       0},
+		{haar_a,  haar_a, -haar_b,       0,       0,  haar_c,       0,       0},
+		{haar_a,  haar_a, -haar_b,       0,       0, -haar_c,       0,       0},
+		{haar_a, -haar_a,       0,  haar_b,       0,       0,  haar_c,       0},
+		{haar_a, -haar_a,       0,  haar_b,       0,       0, -haar_c,       0},
+		{haar_a, -haar_a,       0, -haar_b,       0,       0,       0,  haar_c},
+		{haar_a, -haar_a,       0, -haar_b,       0,       0,       0, -haar_c}
 	};
 
-float Q_haar_data_default[8][8] =
+constexpr float Q_haar_data_default[8][8] =
 	{
 		{ 8.f, 12.f, 16.f, 16.f, 24.f, 24.f, 24.f, 24.f},
 		{12.f, 12.f, 16.f, 16.f, 24.f, 24.f, 24.f, 24.f},
@@ -92,15 +142,45 @@ float Q_haar_data_default[8][8] =
 		{24.f, 24.f, 32.f, 32.f, 38.f, 38.f, 38.f, 38.f}
 	};
 
+constexpr auto T_haar = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromArray(T_haar_data).transpose();
+constexpr auto Q_haar_default = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromArray(Q_haar_data_default);
 
 
-math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> T_haar = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromArray(T_haar_data).transpose();
-math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> Q_haar_default = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromArray(Q_haar_data_default);
+// --- PRECOMPUTED ---
 
+constexpr BlockTransform DCT_TRANSFORM{T_dct, T_dct.transpose()};
+constexpr BlockTransform HAAR_TRANSFORM{T_haar, T_haar.transpose()};
 
-// --- UTILS ---
-math::MatrixIndex zig_zag_indices[64] =
+// also used at runtime whenever the quantization tables change
+constexpr math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> reciprocal(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& table)
+{
+	return math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>::FromFunction([&table](size_t i, size_t j) {
+		return 1.f / table.data[i][j];
+	});
+}
+
+constexpr auto Q_dct_reciprocal_default = reciprocal(Q_dct_default);
+constexpr auto Q_haar_reciprocal_default = reciprocal(Q_haar_default);
+
+// a block with only its DC coefficient decodes to a flat block when every entry of the first row of T is equal
+constexpr bool has_constant_first_row(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& matrix)
+{
+	for (size_t j = 1; j < BLOCK_SIZE; j++)
 	{
+		if (matrix.data[0][j] != matrix.data[0][0])
+			return false;
+	}
+
+	return true;
+}
+
+static_assert(has_constant_first_row(DCT_TRANSFORM.matrix), "DC-only DCT blocks must decode to a flat block");
+static_assert(has_constant_first_row(HAAR_TRANSFORM.matrix), "DC-only Haar blocks must decode to a flat block");
+
+
+// --- UTILS ---
+constexpr std::array<math::MatrixIndex, BLOCK_SIZE * BLOCK_SIZE> zig_zag_indices =
+	{{
 		{0, 0},
 		{0, 1}, {1, 0},
 		{2, 0}, {1, 1}, {0, 2},
@@ -116,30 +196,508 @@ math::MatrixIndex zig_zag_indices[64] =
 		{7, 5}, {6, 6}, {5, 7},
 		{6, 7}, {7, 6},
 		{7, 7},
-	};
+	}};
+
+constexpr auto raster_indices = math::raster_order<BLOCK_SIZE, BLOCK_SIZE>();
+
+// zig_zag_extents[n] is the side of the smallest top-left square holding the first n zig-zag coefficients
+constexpr auto zig_zag_extents = [] {
+	std::array<size_t, BLOCK_SIZE * BLOCK_SIZE + 1> extents{};
+
+	for (size_t n = 1; n < extents.size(); n++)
+	{
+		const auto& index = zig_zag_indices[n - 1];
+		extents[n] = std::max(extents[n - 1], std::max(index.i, index.j) + 1);
+	}
+
+	return extents;
+}();
+
+// short blocks with at most this many coefficients use the reduced inverse transform
+constexpr size_t SPARSE_COEFFICIENTS = 10;
+constexpr size_t SPARSE_EXTENT = zig_zag_extents[SPARSE_COEFFICIENTS];
+static_assert(SPARSE_EXTENT == 4, "The first 10 zig-zag coefficients fit in the top-left 4x4 corner");
+
+// number of leading coefficients a block may hold, from its info byte
+constexpr size_t coefficient_count(uint8_t info_byte)
+{
+	if (info_byte & static_cast<uint8_t>(InfoByte::IsLong))
+		return BLOCK_SIZE * BLOCK_SIZE;
+
+	return info_byte & 0x3F;
+}
+
+// computes T^t * beta * T when beta is zero outside of its top-left K x K corner. The sums are accumulated in the same
+// order as Matrix::product and the skipped terms are exact zeros, so the result is identical to the dense product.
+template<size_t K>
+math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> inverse_kernel(
+	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& beta, const BlockTransform& transform)
+{
+	math::Matrix<K, BLOCK_SIZE, float> right; // beta * T, only the first K rows are non-zero
+
+	for (size_t i = 0; i < K; i++)
+	{
+		for (size_t j = 0; j < BLOCK_SIZE; j++)
+		{
+			float sum = 0;
+			for (size_t k = 0; k < K; k++)
+			{
+				sum += beta.data[i][k] * transform.matrix.data[k][j];
+			}
+
+			right.data[i][j] = sum;
+		}
+	}
+
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> result;
+
+	for (size_t i = 0; i < BLOCK_SIZE; i++)
+	{
+		for (size_t j = 0; j < BLOCK_SIZE; j++)
+		{
+			float sum = 0;
+			for (size_t k = 0; k < K; k++)
+			{
+				sum += transform.transposed.data[i][k] * right.data[k][j];
+			}
+
+			result.data[i][j] = sum;
+		}
+	}
+
+	return result;
+}
+
+// number of blocks needed to cover a dimension (the last block may be partial)
+constexpr uint32_t block_count(uint32_t pixels)
+{
+	return static_cast<uint32_t>((pixels + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+// --- BITS ---
+
+// number of zeros above the highest set bit (value must not be 0)
+inline size_t leading_zeros(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return 63 - static_cast<size_t>(index);
+#else
+	return static_cast<size_t>(__builtin_clzll(value));
+#endif
+}
+
+inline size_t set_bits(uint64_t value)
+{
+	return std::bitset<64>(value).count();
+}
+
+constexpr uint64_t reverse_bits(uint64_t value)
+{
+	value = ((value >> 1) & 0x5555555555555555) | ((value & 0x5555555555555555) << 1);
+	value = ((value >> 2) & 0x3333333333333333) | ((value & 0x3333333333333333) << 2);
+	value = ((value >> 4) & 0x0F0F0F0F0F0F0F0F) | ((value & 0x0F0F0F0F0F0F0F0F) << 4);
+	value = ((value >> 8) & 0x00FF00FF00FF00FF) | ((value & 0x00FF00FF00FF00FF) << 8);
+	value = ((value >> 16) & 0x0000FFFF0000FFFF) | ((value & 0x0000FFFF0000FFFF) << 16);
+	return (value >> 32) | (value << 32);
+}
+
+// --- PACKING ---
+
+// offset of each zig-zag position in a row-major block
+constexpr auto zig_zag_offsets = [] {
+	std::array<uint8_t, BLOCK_SIZE * BLOCK_SIZE> offsets{};
+
+	for (size_t k = 0; k < offsets.size(); k++)
+	{
+		offsets[k] = static_cast<uint8_t>(BLOCK_SIZE * zig_zag_indices[k].i + zig_zag_indices[k].j);
+	}
+
+	return offsets;
+}();
+
+#if defined(SQH_SSSE3)
+// pshufb controls: [output][source] moves the bytes of 16-byte chunk "source" that belong to chunk "output" of the
+// zig-zag order, every other lane is cleared (0x80)
+alignas(16) constexpr auto zig_zag_shuffles = [] {
+	std::array<std::array<std::array<uint8_t, 16>, 4>, 4> shuffles{};
+
+	for (size_t output = 0; output < 4; output++)
+	{
+		for (size_t source = 0; source < 4; source++)
+		{
+			for (size_t lane = 0; lane < 16; lane++)
+			{
+				const uint8_t offset = zig_zag_offsets[16 * output + lane];
+				shuffles[output][source][lane] = (offset / 16 == source) ? static_cast<uint8_t>(offset % 16) : 0x80;
+			}
+		}
+	}
+
+	return shuffles;
+}();
+
+// pshufb controls moving the bytes selected by an 8 bit mask to the front of an 8 byte group
+alignas(16) constexpr auto compress_shuffles = [] {
+	std::array<std::array<uint8_t, 16>, 256> shuffles{};
+
+	for (size_t mask = 0; mask < shuffles.size(); mask++)
+	{
+		size_t count = 0;
+		for (uint8_t lane = 0; lane < 16; lane++)
+		{
+			shuffles[mask][lane] = 0x80;
+		}
+		for (uint8_t lane = 0; lane < 8; lane++)
+		{
+			if (mask & (1u << lane))
+				shuffles[mask][count++] = lane;
+		}
+	}
+
+	return shuffles;
+}();
+#endif
+
+#if defined(SQH_SSSE3_DISPATCH)
+bool cpu_has_ssse3()
+{
+#if defined(_MSC_VER)
+	int registers[4] = {};
+	__cpuid(registers, 1);
+	return (registers[2] & (1 << 9)) != 0;
+#else
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	return __get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0 && (ecx & bit_SSSE3) != 0;
+#endif
+}
+
+const bool HAS_SSSE3 = cpu_has_ssse3();
+#elif defined(SQH_SSSE3)
+constexpr bool HAS_SSSE3 = true;
+#else
+constexpr bool HAS_SSSE3 = false;
+#endif
+
+#if defined(SQH_SSSE3)
+SQH_SSSE3_TARGET void zig_zag_permute_ssse3(const int8_t* block, int8_t* output)
+{
+	__m128i chunks[4];
+	for (size_t source = 0; source < 4; source++)
+	{
+		chunks[source] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * source));
+	}
+
+	for (size_t part = 0; part < 4; part++)
+	{
+		__m128i result = _mm_setzero_si128();
+		for (size_t source = 0; source < 4; source++)
+		{
+			const auto* control = reinterpret_cast<const __m128i*>(zig_zag_shuffles[part][source].data());
+			result = _mm_or_si128(result, _mm_shuffle_epi8(chunks[source], _mm_load_si128(control)));
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(output + 16 * part), result);
+	}
+}
+
+// writes the values whose bit is set in mask contiguously to output (which must hold 64 values), returns their count
+SQH_SSSE3_TARGET size_t compress_store_ssse3(const int8_t* values, uint64_t mask, int8_t* output)
+{
+	size_t count = 0;
+	for (size_t group = 0; group < BLOCK_SIZE * BLOCK_SIZE / 8; group++)
+	{
+		const auto group_mask = static_cast<uint8_t>(mask >> (8 * group));
+		const auto* control = reinterpret_cast<const __m128i*>(compress_shuffles[group_mask].data());
+
+		__m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(values + 8 * group));
+		__m128i packed = _mm_shuffle_epi8(bytes, _mm_load_si128(control));
+
+		// count <= 8 * group here, so the 8 byte store stays inside the 64 byte output
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(output + count), packed);
+		count += set_bits(group_mask);
+	}
+
+	return count;
+}
+#endif
+
+void zig_zag_permute(const int8_t* block, int8_t* output)
+{
+#if defined(SQH_SSSE3)
+	if (HAS_SSSE3)
+	{
+		zig_zag_permute_ssse3(block, output);
+		return;
+	}
+#endif
+
+	for (size_t k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++)
+	{
+		output[k] = block[zig_zag_offsets[k]];
+	}
+}
+
+// bit k is set when values[k] is not 0
+uint64_t nonzero_mask(const int8_t* values)
+{
+#if defined(SQH_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+
+	uint64_t mask = 0;
+	for (size_t part = 0; part < 4; part++)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + 16 * part));
+		auto zeros = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)));
+		mask |= static_cast<uint64_t>(~zeros & 0xFFFF) << (16 * part);
+	}
+
+	return mask;
+#else
+	uint64_t mask = 0;
+	for (size_t k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++)
+	{
+		mask |= static_cast<uint64_t>(values[k] != 0) << k;
+	}
+
+	return mask;
+#endif
+}
 
-math::MatrixIndex flatten_horiz(size_t index, size_t r, size_t c)
+// writes the values whose bit is set in mask contiguously to output (which must hold 64 values), returns their count
+size_t compress_store(const int8_t* values, uint64_t mask, int8_t* output)
 {
-	return {index / c, index % c};
+#if defined(SQH_SSSE3)
+	if (HAS_SSSE3)
+		return compress_store_ssse3(values, mask, output);
+#endif
+
+	size_t count = 0;
+	for (size_t k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++)
+	{
+		output[count] = values[k];
+		count += (mask >> k) & 1;
+	}
+
+	return count;
 }
 
-math::MatrixIndex zig_zag_flatten(size_t index)
+// read-only stream buffer over bytes in memory, so that decoding from memory goes through the same std::istream code
+class MemoryBuffer : public std::streambuf
+{
+public:
+	MemoryBuffer(const uint8_t* data, size_t size)
+	{
+		auto begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+		setg(begin, begin, begin + size);
+	}
+
+protected:
+	// seeking lets pyramids jump to one of their levels
+	pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode) override
+	{
+		char* origin = direction == std::ios_base::beg ? eback() : direction == std::ios_base::cur ? gptr() : egptr();
+		if (offset < eback() - origin || offset > egptr() - origin)
+			return pos_type(off_type(-1));
+
+		setg(eback(), origin + offset, egptr());
+		return pos_type(gptr() - eback());
+	}
+
+	pos_type seekpos(pos_type position, std::ios_base::openmode which) override
+	{
+		return seekoff(off_type(position), std::ios_base::beg, which);
+	}
+};
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point start)
 {
-	return zig_zag_indices[index];
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
 }
 
+constexpr uint8_t PADDING_VALUE = 128;
 constexpr uint64_t TABLE_BITMASK = uint64_t(1) << 63;
+
+// pass k of a progressive file holds the zig-zag coefficients [PROGRESSIVE_BANDS[k], PROGRESSIVE_BANDS[k + 1]) of every
+// block. Pass 0 holds an info byte per block, with IsDct and the length of the block (the number of zig-zag
+// coefficients up to its last non-zero one), followed by its DC coefficient when the length is not 0. In the next
+// passes, a block whose length reaches into the band stores a bit mask of the non-zero coefficients of the band, up to
+// its length, and then their values
+constexpr std::array<size_t, 5> PROGRESSIVE_BANDS = {0, 1, 6, 15, BLOCK_SIZE * BLOCK_SIZE};
+constexpr uint32_t PROGRESSIVE_PASSES = PROGRESSIVE_BANDS.size() - 1;
+constexpr uint8_t PROGRESSIVE_LENGTH_MASK = 0x7F;
+
+// coefficients of band pass a block of this length has (including zeros)
+constexpr size_t band_span(size_t length, size_t pass)
+{
+	return length > PROGRESSIVE_BANDS[pass] ? std::min(length, PROGRESSIVE_BANDS[pass + 1]) - PROGRESSIVE_BANDS[pass] : 0;
+}
+
+// bytes of the bit masks of every band of a block of this length
+constexpr size_t band_mask_bytes(size_t length)
+{
+	size_t bytes = 0;
+	for (size_t pass = 1; pass < PROGRESSIVE_PASSES; pass++)
+	{
+		bytes += (band_span(length, pass) + 7) / 8;
+	}
+	return bytes;
+}
+
+// position of every raster coefficient in the zig-zag order
+constexpr auto zig_zag_ranks = [] {
+	std::array<size_t, BLOCK_SIZE * BLOCK_SIZE> ranks{};
+
+	for (size_t n = 0; n < ranks.size(); n++)
+	{
+		ranks[BLOCK_SIZE * zig_zag_indices[n].i + zig_zag_indices[n].j] = n;
+	}
+
+	return ranks;
+}();
+
+// bytes the block takes in the passes of a progressive file
+size_t progressive_size(const CompressedBlock& block)
+{
+	size_t length = 0;
+	size_t ac_values = 0;
+
+	if (block.infoByte & static_cast<uint8_t>(InfoByte::IsLong))
+	{
+		for (uint64_t table = block.table; table != 0; )
+		{
+			size_t position = leading_zeros(table);
+			length = std::max(length, zig_zag_ranks[position] + 1);
+			ac_values += position != 0 ? 1 : 0;
+			table &= ~(TABLE_BITMASK >> position);
+		}
+	}
+	else
+	{
+		// short blocks end with a non-zero coefficient
+		length = block.dataCount;
+		for (size_t n = 1; n < length; n++)
+		{
+			ac_values += block.data[n] != 0 ? 1 : 0;
+		}
+	}
+
+	return 1 + (length != 0 ? 1 : 0) + band_mask_bytes(length) + ac_values;
+}
 constexpr size_t DEFAULT_BLOCK_MEM_SIZE = BLOCK_SIZE * BLOCK_SIZE;
 constexpr size_t OPTIMIZATION_ATTEMPTS = 3;
 constexpr float LEARN_RATE = 0.25f;
 
+// AKA alpha_tilde (equation 12.9)
+math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> forward_transform(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& block,
+                                                              const BlockTransform& transform)
+{
+	// AKA f_tilde
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> shifted_data = block.cast<float>() - 128.f;
+
+	return transform.matrix.product(shifted_data.product(transform.transposed));
+}
+
+// AKA l (the division by Q is a multiplication by its precomputed reciprocal, fused with the rounding). Tables too fine
+// for the block give values outside of int8_t, which are saturated rather than cast
+math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t> quantize(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& coefficients,
+                                                      const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& reciprocal)
+{
+	return (coefficients * reciprocal + 0.5f).floor().clamp(-128.f, 127.f).cast<int8_t>();
+}
+
+// at most this many blocks are used to tune the quantization tables, which bounds the cost of the tuning
+constexpr size_t OPTIMIZATION_SAMPLES = 6144;
+// the samples are split in this many chunks, each with its own partial sums
+constexpr size_t OPTIMIZATION_CHUNKS = 64;
+
+// blocks sampled over a whole training corpus (each is about 600 bytes)
+constexpr size_t TRAINING_SAMPLES = 1 << 17;
+
+// blocks encodeToSize() keeps with their transforms (about 20 MB), larger images are searched on a sample of them
+constexpr size_t RATE_SAMPLES = 1 << 15;
+
+// well spread 64 bit hash (the finalizer of splitmix64)
+constexpr uint64_t mix_bits(uint64_t value)
+{
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EB;
+	return value ^ (value >> 31);
+}
+
+// range of the table scales searched by encodeToSize(), and the precision it stops at. Below the base tables, the search
+// also stops at the first scale at which the coefficients fit in int8_t: finer tables only saturate them
+constexpr float MIN_RATE_SCALE = 0.25f;
+constexpr float MAX_RATE_SCALE = 64.f;
+constexpr float RATE_SCALE_PRECISION = 0.01f;
+
+// magic number, header and both quantization tables
+constexpr uint64_t FILE_PREAMBLE_SIZE = sizeof(uint32_t) + sizeof(SquashHeader) + 2 * BLOCK_SIZE * BLOCK_SIZE;
+
+// tiles of tile_size pixels covering a row or a column of blocks blocks
+constexpr uint32_t tile_count(uint32_t blocks, uint32_t tile_size)
+{
+	uint32_t tile_blocks = tile_size / BLOCK_SIZE;
+	return (blocks + tile_blocks - 1) / tile_blocks;
+}
+
+// levels of a resolution pyramid of the image, up to requested_levels: each is half the size of the previous one
+// (rounding up), and the last one may be a single pixel
+uint32_t pyramid_level_count(const SquashHeader& header, unsigned int requested_levels)
+{
+	uint32_t count = 1;
+	for (uint32_t x = header.size_x, y = header.size_y; count < requested_levels && (x > 1 || y > 1); count++)
+	{
+		x = (x + 1) / 2;
+		y = (y + 1) / 2;
+	}
+	return count;
+}
+
+// openLazy() decodes the blocks by groups of up to this many block positions of a row
+constexpr uint32_t LAZY_GROUP_BLOCKS = 16;
+constexpr size_t LAZY_GROUP_STRIDE = 3 * BLOCK_SIZE * LAZY_GROUP_BLOCKS;
+constexpr size_t LAZY_GROUP_BYTES = BLOCK_SIZE * LAZY_GROUP_STRIDE;
+
+// bands of rows per encoding thread, so that threads which get faster bands are not left idle
+constexpr size_t BANDS_PER_THREAD = 4;
+
+void add_stats(EncodeStats& total, const EncodeStats& band)
+{
+	total.dctBlocks += band.dctBlocks;
+	total.haarBlocks += band.haarBlocks;
+	total.shortBlocks += band.shortBlocks;
+	total.longBlocks += band.longBlocks;
+	for (size_t c = 0; c < band.channelBytes.size(); c++)
+	{
+		total.channelBytes[c] += band.channelBytes[c];
+	}
+	total.averageQuality += band.averageQuality;
+}
+
 } // namespace
 
-double SquashImage::Quality = 0.5f;
+// a block of the tuning sample, with both of its transforms
+struct SquashImage::OptimizationSample
+{
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> pixels;
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> dct;
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> haar;
+};
 
-SquashImage::SquashImage(std::string_view file_path)
+SquashImage::SquashImage()
 : m_dctQTable(Q_dct_default)
 , m_haarQTable(Q_haar_default)
+, m_dctQReciprocal(Q_dct_reciprocal_default)
+, m_haarQReciprocal(Q_haar_reciprocal_default)
+{
+}
+
+SquashImage::SquashImage(std::string_view file_path)
+: SquashImage()
 {
 	open(file_path);
 }
@@ -168,7 +726,7 @@ bool SquashImage::open(std::string_view file_path)
 	return false;
 }
 
-bool SquashImage::save(std::string_view file_path, bool overwrite)
+bool SquashImage::save(std::string_view file_path, bool overwrite, const EncoderOptions& options)
 {
 	fs::path path(file_path);
 
@@ -179,7 +737,7 @@ bool SquashImage::save(std::string_view file_path, bool overwrite)
 
 	if (path.extension() == ".sqh")
 	{
-		return save_sqh(file_path, overwrite);
+		return save_sqh(file_path, overwrite, options);
 	}
 
 	std::cout << "[ERROR] (SquashImage): Unknown/unsupported file extension: \""
@@ -189,6 +747,8 @@ bool SquashImage::save(std::string_view file_path, bool overwrite)
 
 bool SquashImage::open_png(std::string_view file_path)
 {
+	SQH_TRACE_SCOPE("open_png");
+
 	int width, height, channelCount;
 	m_data = stbi_load(std::string(file_path).c_str(), &width, &height, &channelCount, 3);
 
@@ -204,6 +764,8 @@ bool SquashImage::open_png(std::string_view file_path)
 
 bool SquashImage::save_png(std::string_view file_path, bool overwrite)
 {
+	SQH_TRACE_SCOPE("save_png");
+
 	if (m_data == nullptr)
 		return false;
 
@@ -220,339 +782,1840 @@ bool SquashImage::save_png(std::string_view file_path, bool overwrite)
 	return true;
 }
 
-bool SquashImage::open_sqh(std::string_view file_path)
+bool SquashImage::open_sqh(std::string_view file_path, float scale)
 {
 	std::ifstream input_file(std::string(file_path), std::ios::binary);
 
-	uint32_t magic_number;
-	input_file.read(reinterpret_cast<char*>(&magic_number), sizeof(uint32_t));
-
-	if (magic_number != MAGIC_NUMBER)
-	{
-		std::cout << "[ERROR] (SquashImage): File \"" << file_path << "\" does not start with the correct magic number"
-			<< std::endl;
-
-		input_file.close();
-		return false;
-	}
-
-	input_file.read(reinterpret_cast<char*>(&m_header), sizeof(SquashHeader));
-
-	uint8_t q_data[BLOCK_SIZE][BLOCK_SIZE] = {};
-	input_file.read(reinterpret_cast<char*>(q_data), sizeof(uint8_t) * BLOCK_SIZE * BLOCK_SIZE);
-	m_dctQTable = math::Matrix<8, 8, uint8_t>::FromArray(q_data).asType<float>();
-	input_file.read(reinterpret_cast<char*>(q_data), sizeof(uint8_t) * BLOCK_SIZE * BLOCK_SIZE);
-	m_haarQTable = math::Matrix<8, 8, uint8_t>::FromArray(q_data).asType<float>();
-
-	auto result = decompress(input_file);
+	auto result = read_sqh(input_file, file_path, scale);
 
 	input_file.close();
 	return result;
 }
 
-bool SquashImage::save_sqh(std::string_view file_path, bool overwrite)
+bool SquashImage::save_sqh(std::string_view file_path, bool overwrite, const EncoderOptions& options) const
 {
 	if  (m_data == nullptr)
 		return false;
 
-	std::ofstream output_file(std::string(file_path), std::ios::binary);
+#if defined(SQH_POSIX_IO)
+	int file_descriptor = ::open(std::string(file_path).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file_descriptor < 0)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not open file for writing: " << file_path << std::endl;
+		return false;
+	}
 
-	output_file.write(reinterpret_cast<const char*>(&MAGIC_NUMBER), sizeof(uint32_t));
-	output_file.write(reinterpret_cast<char*>(&m_header), sizeof(SquashHeader));
+	BlockWriter output(file_descriptor, 0);
+#else
+	std::ofstream output_file(std::string(file_path), std::ios::binary);
+	BlockWriter output(output_file);
+#endif
 
-	auto result = compress(output_file);
+	auto result = write_sqh(output, options);
 
+#if defined(SQH_POSIX_IO)
+	::close(file_descriptor);
+#else
 	output_file.close();
+#endif
 	return result;
 }
 
-uint8_t* SquashImage::getData()
+bool SquashImage::encode(std::vector<uint8_t>& output, const EncoderOptions& options) const
 {
-	return m_data;
-}
+	if  (m_data == nullptr)
+		return false;
 
-const SquashHeader& SquashImage::getHeader()
-{
-	return m_header;
+	BlockWriter writer(output);
+	return write_sqh(writer, options);
 }
 
-void SquashImage::free()
+bool SquashImage::encodeLadder(const std::vector<float>& scales, std::vector<std::vector<uint8_t>>& outputs,
+                               const EncoderOptions& options, std::vector<EncodeStats>* stats) const
 {
-	::free(m_data);
-}
+	if  (m_data == nullptr)
+		return false;
 
-math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t> SquashImage::transform_block(
-	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> &block,
-    const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> &transform_matrix,
-    const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> &quantization_matrix,
-	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>* coefficients)
-{
-	// AKA f_tilde
-	auto shifted_data = block.asType<float>([](uint8_t input) -> float {
-		return static_cast<float>(input) - 128.f;
-	});
+	// checked before the tables are tuned, the ladder writes every file in a single pass over the blocks
+	if (options.pyramidLevels > 1)
+	{
+		std::cout << "[ERROR] (SquashImage): A pyramid cannot be encoded as a ladder" << std::endl;
+		return false;
+	}
 
-	// AKA alpha_tilde (equation 12.9)
-	auto transformed_data = transform_matrix.product(shifted_data.product(transform_matrix.transpose()));
-	if (coefficients != nullptr)
+	if (options.progressive)
+	{
+		std::cout << "[ERROR] (SquashImage): Progressive files can only be written one at a time" << std::endl;
+		return false;
+	}
+
+	// the ladder scales the tuned tables, when there are any
+	auto start = Clock::now();
+	auto base = base_level(options);
+	auto optimize_time = elapsed_ms(start);
+
+	std::vector<EncodeLevel> levels;
+	for (float scale : scales)
+	{
+		levels.push_back(make_level(scaleQTable(base.dctTable, scale), scaleQTable(base.haarTable, scale)));
+	}
+
+	outputs.assign(scales.size(), {});
+	std::vector<std::unique_ptr<BlockWriter>> writers;
+	std::vector<BlockWriter*> writer_pointers;
+	for (auto& output : outputs)
+	{
+		writers.push_back(std::make_unique<BlockWriter>(output));
+		writer_pointers.push_back(writers.back().get());
+	}
+
+	std::vector<EncodeStats> local_stats;
+	auto& ladder_stats = stats != nullptr ? *stats : local_stats;
+	auto result = write_sqh(writer_pointers, levels, options, ladder_stats);
+
+	for (auto& level_stats : ladder_stats)
+	{
+		level_stats.optimizeTime = optimize_time;
+	}
+
+	return result;
+}
+
+bool SquashImage::encodeToSize(std::vector<uint8_t>& output, uint64_t target_bytes, const EncoderOptions& options,
+                               float* chosen_scale) const
+{
+	SQH_TRACE_SCOPE("encodeToSize");
+
+	if  (m_data == nullptr)
+		return false;
+
+	if (options.pyramidLevels > 1)
+	{
+		std::cout << "[ERROR] (SquashImage): A pyramid cannot be encoded to a target size" << std::endl;
+		return false;
+	}
+
+	auto start = Clock::now();
+	unsigned int thread_count = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	auto base = base_level(options);
+	auto scaled_level = [&](float scale) {
+		return make_level(scaleQTable(base.dctTable, scale), scaleQTable(base.haarTable, scale));
+	};
+
+	// the blocks with their transforms, so that a candidate only costs the quantization and the block choice. Past
+	// RATE_SAMPLES blocks, a sample spread over the image stands for all of them and the sizes are extrapolated
+	std::vector<OptimizationSample> blocks;
+	collect_samples(RATE_SAMPLES, thread_count, blocks);
+	const size_t total_blocks = 3 * static_cast<size_t>(block_count(m_header.size_x)) * block_count(m_header.size_y);
+	const double extrapolation = static_cast<double>(total_blocks) / static_cast<double>(std::max<size_t>(blocks.size(), 1));
+
+	// each candidate is sized on a single thread, thread_count candidates at a time
+	std::vector<std::pair<float, uint64_t>> sizes;
+	auto evaluate = [&](const std::vector<float>& scales) {
+		std::vector<uint64_t> candidate_sizes(scales.size());
+		for_each_parallel(scales.size(), thread_count, [&](size_t k) {
+			auto block_bytes = static_cast<double>(estimate_size(blocks, scaled_level(scales[k]), options, 1));
+			candidate_sizes[k] = preamble_size(options) + static_cast<uint64_t>(std::ceil(block_bytes * extrapolation));
+		});
+
+		for (size_t k = 0; k < scales.size(); k++)
+		{
+			sizes.emplace_back(scales[k], candidate_sizes[k]);
+		}
+	};
+
+	// the file shrinks as the scale grows: the search keeps low (too large) and high (fits), and splits the range
+	// between them geometrically into thread_count + 1 parts per round. Returns false if high does not fit
+	auto search = [&](uint64_t budget, float low, float high, float& chosen) {
+		sizes.clear();
+		evaluate({low, high});
+
+		if (sizes[0].second <= budget)
+		{
+			chosen = low;
+			return true;
+		}
+		if (sizes[1].second > budget)
+			return false;
+
+		while (high / low > 1.f + RATE_SCALE_PRECISION)
+		{
+			std::vector<float> scales;
+			for (unsigned int k = 1; k <= thread_count; k++)
+			{
+				scales.push_back(low * std::pow(high / low, static_cast<float>(k) / static_cast<float>(thread_count + 1)));
+			}
+
+			size_t first = sizes.size();
+			evaluate(scales);
+
+			// the smallest fitting candidate is the new high, and the largest one below it that does not fit the new low
+			float new_high = high;
+			for (size_t k = first; k < sizes.size(); k++)
+			{
+				if (sizes[k].second <= budget)
+				{
+					new_high = sizes[k].first;
+					break;
+				}
+			}
+			for (size_t k = first; k < sizes.size() && sizes[k].first < new_high; k++)
+			{
+				low = sizes[k].first;
+			}
+			high = new_high;
+		}
+
+		chosen = high;
+		return true;
+	};
+
+	// the sizes do not always shrink with the scale (the blocks switch transforms), so a budget the base tables fit is
+	// only searched below them, down to where the coefficients still fit in int8_t: it never gets a worse image
+	float chosen = 0.f;
+	float finest = std::min(fitting_scale(blocks, base), 1.f);
+	sizes.clear();
+	evaluate({1.f});
+	bool base_fits = sizes[0].second <= target_bytes;
+
+	if (!(base_fits ? search(target_bytes, finest, 1.f, chosen) : search(target_bytes, 1.f, MAX_RATE_SCALE, chosen)))
+	{
+		std::cout << "[ERROR] (SquashImage): The image does not fit in " << target_bytes << " bytes, it needs about "
+		          << sizes[1].second << std::endl;
+		return false;
+	}
+
+	// extrapolated sizes can be a little short: the chosen scale is sized on every block, and while it does not fit,
+	// searched again above it with the budget reduced by the error
+	if (blocks.size() < total_blocks)
+	{
+		uint64_t budget = target_bytes;
+		uint64_t size = preamble_size(options) + image_size(scaled_level(chosen), options, thread_count);
+
+		while (size > target_bytes)
+		{
+			float previous = chosen;
+			budget = static_cast<uint64_t>(static_cast<double>(budget) * static_cast<double>(target_bytes) / static_cast<double>(size));
+			if (previous >= MAX_RATE_SCALE || !search(budget, previous, MAX_RATE_SCALE, chosen))
+			{
+				std::cout << "[ERROR] (SquashImage): The image does not fit in " << target_bytes << " bytes, it needs at "
+				          << "least " << size << std::endl;
+				return false;
+			}
+
+			chosen = std::min(std::max(chosen, previous * (1.f + RATE_SCALE_PRECISION)), MAX_RATE_SCALE);
+			size = preamble_size(options) + image_size(scaled_level(chosen), options, thread_count);
+		}
+	}
+	blocks = {};
+
+	if (chosen_scale != nullptr)
+		*chosen_scale = chosen;
+
+	BlockWriter writer(output);
+	return write_sqh(writer, scaled_level(chosen), options, elapsed_ms(start));
+}
+
+SizeEstimate SquashImage::estimateSize(const EncoderOptions& options, double sample_fraction) const
+{
+	SQH_TRACE_SCOPE("estimateSize");
+
+	SizeEstimate estimate;
+	if  (m_data == nullptr)
+		return estimate;
+
+	unsigned int thread_count = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	auto tables = base_level(options);
+
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
+	size_t positions = static_cast<size_t>(x_blocks) * y_blocks;
+	estimate.totalBlocks = 3 * positions;
+
+	// at least two positions, for the variance
+	auto sample_positions = static_cast<size_t>(std::ceil(std::max(sample_fraction, 0.0) * static_cast<double>(positions)));
+	sample_positions = std::max<size_t>(sample_positions, 2);
+
+	if (sample_positions >= positions)
+	{
+		estimate.bytes = preamble_size(options) + image_size(tables, options, thread_count);
+		estimate.sampledBlocks = estimate.totalBlocks;
+		return estimate;
+	}
+
+	std::vector<OptimizationSample> samples;
+	collect_samples(3 * sample_positions, thread_count, samples);
+	estimate.sampledBlocks = samples.size();
+
+	// the three channels of a position are consecutive samples
+	std::vector<double> position_bytes(sample_positions);
+	size_t chunk_count = std::min(sample_positions, OPTIMIZATION_CHUNKS);
+
+	for_each_parallel(chunk_count, thread_count, [&](size_t chunk) {
+		for (size_t k = sample_positions * chunk / chunk_count; k < sample_positions * (chunk + 1) / chunk_count; k++)
+		{
+			for (size_t c = 0; c < 3; c++)
+			{
+				const auto& sample = samples[3 * k + c];
+
+				CompressedBlock best_block;
+				double quality = 0.0;
+				encode_block(sample.pixels, sample.dct, sample.haar, tables, options, best_block, quality);
+				position_bytes[k] += static_cast<double>(stored_size(best_block, options));
+			}
+		}
+	});
+
+	double mean = 0.0;
+	for (double bytes : position_bytes)
+	{
+		mean += bytes;
+	}
+	mean /= static_cast<double>(sample_positions);
+
+	double variance = 0.0;
+	for (double bytes : position_bytes)
+	{
+		variance += (bytes - mean) * (bytes - mean);
+	}
+	variance /= static_cast<double>(sample_positions - 1);
+
+	// standard error of a simple random sample without replacement. The sample is stratified, which can only lower the
+	// actual error, so the bound is on the safe side
+	auto n = static_cast<double>(sample_positions);
+	auto N = static_cast<double>(positions);
+	double standard_error = N * std::sqrt((1.0 - n / N) * variance / n);
+
+	estimate.bytes = preamble_size(options) + static_cast<uint64_t>(std::llround(N * mean));
+	estimate.errorBound = static_cast<uint64_t>(std::ceil(1.96 * standard_error));
+	return estimate;
+}
+
+bool SquashImage::decode(const std::vector<uint8_t>& input, float scale)
+{
+	MemoryBuffer buffer(input.data(), input.size());
+	std::istream input_stream(&buffer);
+
+	return read_sqh(input_stream, "<memory>", scale);
+}
+
+bool SquashImage::read_preamble(std::istream& input_file, std::string_view source_name, uint32_t& magic_number)
+{
+	magic_number = 0;
+	input_file.read(reinterpret_cast<char*>(&magic_number), sizeof(uint32_t));
+
+	if (magic_number != MAGIC_NUMBER && magic_number != TILED_MAGIC_NUMBER && magic_number != PYRAMID_MAGIC_NUMBER
+	    && magic_number != PROGRESSIVE_MAGIC_NUMBER)
+	{
+		std::cout << "[ERROR] (SquashImage): File \"" << source_name << "\" does not start with the correct magic number"
+			<< std::endl;
+
+		return false;
+	}
+
+	input_file.read(reinterpret_cast<char*>(&m_header), sizeof(SquashHeader));
+
+	// the levels of a pyramid have their own tables
+	if (magic_number == PYRAMID_MAGIC_NUMBER)
+		return true;
+
+	uint8_t q_data[BLOCK_SIZE][BLOCK_SIZE] = {};
+	input_file.read(reinterpret_cast<char*>(q_data), sizeof(uint8_t) * BLOCK_SIZE * BLOCK_SIZE);
+	auto dct_table = math::Matrix<8, 8, uint8_t>::FromArray(q_data).asType<float>();
+	input_file.read(reinterpret_cast<char*>(q_data), sizeof(uint8_t) * BLOCK_SIZE * BLOCK_SIZE);
+	auto haar_table = math::Matrix<8, 8, uint8_t>::FromArray(q_data).asType<float>();
+	setQTables(dct_table, haar_table);
+
+	return true;
+}
+
+bool SquashImage::read_sqh(std::istream& input_file, std::string_view source_name, float scale)
+{
+	uint32_t magic_number = 0;
+	if (!read_preamble(input_file, source_name, magic_number))
+		return false;
+
+	if (magic_number == PYRAMID_MAGIC_NUMBER)
+	{
+		// the level is a complete file, which replaces the header of the pyramid
+		if (!seek_pyramid_level(input_file, scale) || !read_preamble(input_file, source_name, magic_number))
+			return false;
+
+		if (magic_number == PYRAMID_MAGIC_NUMBER)
+		{
+			std::cout << "[ERROR] (SquashImage): File \"" << source_name << "\" has a pyramid inside of a pyramid"
+			          << std::endl;
+			return false;
+		}
+	}
+
+	bool result = false;
+	if (magic_number == TILED_MAGIC_NUMBER)
+		result = decompress_tiles(input_file);
+	else if (magic_number == PROGRESSIVE_MAGIC_NUMBER)
+		result = decompress_progressive(input_file);
+	else
+		result = decompress(input_file);
+
+	return result;
+}
+
+bool SquashImage::write_sqh(const std::vector<BlockWriter*>& outputs, const std::vector<EncodeLevel>& levels,
+                           const EncoderOptions& options, std::vector<EncodeStats>& stats) const
+{
+	stats.assign(levels.size(), EncodeStats{});
+
+	if (options.tileSize % BLOCK_SIZE != 0)
+	{
+		std::cout << "[ERROR] (SquashImage): The tile size (" << options.tileSize << ") is not a multiple of "
+		          << BLOCK_SIZE << std::endl;
+		return false;
+	}
+
+	const uint32_t& magic_number = options.tileSize != 0 ? TILED_MAGIC_NUMBER : MAGIC_NUMBER;
+	for (BlockWriter* output : outputs)
+	{
+		output->write(&magic_number, sizeof(uint32_t));
+		output->write(&m_header, sizeof(SquashHeader));
+	}
+
+	if (!compress(outputs, levels, options, stats))
+		return false;
+
+	bool result = true;
+	for (size_t level = 0; level < levels.size(); level++)
+	{
+		auto start = Clock::now();
+		result = outputs[level]->flush() && result;
+		stats[level].flushTime = elapsed_ms(start);
+		stats[level].totalBytes = outputs[level]->size();
+	}
+
+	return result;
+}
+
+bool SquashImage::seek_pyramid_level(std::istream& input_file, float scale)
+{
+	uint32_t level_count = 0;
+	input_file.read(reinterpret_cast<char*>(&level_count), sizeof(uint32_t));
+
+	if (!input_file || level_count == 0 || level_count > pyramid_level_count(m_header, level_count))
+	{
+		std::cout << "[ERROR] (SquashImage): Invalid pyramid level count: " << level_count << std::endl;
+		return false;
+	}
+
+	std::vector<uint64_t> offsets(level_count);
+	input_file.read(reinterpret_cast<char*>(offsets.data()), static_cast<std::streamsize>(level_count * sizeof(uint64_t)));
+
+	// the scale of a level is its width over the image's, the closest one is the closest on a logarithmic scale (a level
+	// twice too large is as far as one twice too small)
+	size_t best_level = 0;
+	double best_distance = std::numeric_limits<double>::infinity();
+	uint32_t level_width = m_header.size_x;
+	for (size_t level = 0; level < level_count; level++)
+	{
+		double level_scale = static_cast<double>(level_width) / static_cast<double>(std::max(m_header.size_x, 1u));
+		double distance = scale > 0.f ? std::abs(std::log(level_scale / scale)) : level_scale;
+		if (distance < best_distance)
+		{
+			best_level = level;
+			best_distance = distance;
+		}
+		level_width = (level_width + 1) / 2;
+	}
+
+	input_file.seekg(static_cast<std::streamoff>(offsets[best_level]));
+
+	if (!input_file)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not read the pyramid index" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool SquashImage::write_sqh(BlockWriter& output, const EncoderOptions& options) const
+{
+	auto start = Clock::now();
+	auto level = base_level(options);
+
+	if (options.pyramidLevels > 1)
+		return write_pyramid(output, level, options, elapsed_ms(start));
+
+	return write_sqh(output, level, options, elapsed_ms(start));
+}
+
+bool SquashImage::write_pyramid(BlockWriter& output, const EncodeLevel& level, const EncoderOptions& options,
+                                double optimize_time) const
+{
+	SQH_TRACE_SCOPE("write_pyramid");
+
+	uint32_t level_count = pyramid_level_count(m_header, options.pyramidLevels);
+
+	// the levels are encoded in memory first, as the index of their offsets comes before them. The statistics are the
+	// ones of the image
+	std::vector<std::vector<uint8_t>> level_data(level_count);
+	{
+		BlockWriter level_output(level_data[0]);
+		if (!write_sqh(level_output, level, options, optimize_time))
+			return false;
+	}
+
+	EncoderOptions level_options = options;
+	level_options.stats = nullptr;
+
+	const SquashImage* previous = this;
+	std::unique_ptr<SquashImage> images[2];
+	for (uint32_t k = 1; k < level_count; k++)
+	{
+		// every level is downscaled from the previous one
+		auto& image = images[k % 2];
+		image = std::make_unique<SquashImage>();
+		if (!previous->half_size(*image))
+			return false;
+
+		BlockWriter level_output(level_data[k]);
+		if (!image->write_sqh(level_output, level, level_options, 0.0))
+			return false;
+
+		previous = image.get();
+	}
+
+	output.write(&PYRAMID_MAGIC_NUMBER, sizeof(uint32_t));
+	output.write(&m_header, sizeof(SquashHeader));
+	output.write(&level_count, sizeof(uint32_t));
+
+	uint64_t offset = output.size() + level_count * sizeof(uint64_t);
+	for (const auto& data : level_data)
+	{
+		output.write(&offset, sizeof(uint64_t));
+		offset += data.size();
+	}
+
+	for (const auto& data : level_data)
+	{
+		output.write(data.data(), data.size());
+	}
+
+	auto result = output.flush();
+	if (options.stats != nullptr)
+		options.stats->totalBytes = output.size();
+
+	return result;
+}
+
+bool SquashImage::write_progressive(BlockWriter& output, const std::vector<uint8_t>& sequential) const
+{
+	SQH_TRACE_SCOPE("write_progressive");
+
+	MemoryBuffer buffer(sequential.data() + FILE_PREAMBLE_SIZE, sequential.size() - FILE_PREAMBLE_SIZE);
+	std::istream input(&buffer);
+
+	const size_t blocks = 3 * static_cast<size_t>(block_count(m_header.size_x)) * block_count(m_header.size_y);
+
+	// the info byte of pass 0 and the zig-zag coefficients of every block, in the order of the sequential file
+	std::vector<uint8_t> info_bytes(blocks);
+	std::vector<int8_t> coefficients(blocks * BLOCK_SIZE * BLOCK_SIZE);
+	std::array<uint64_t, PROGRESSIVE_PASSES> pass_sizes{};
+
+	for (size_t b = 0; b < blocks; b++)
+	{
+		uint8_t info_byte = 0;
+		input.read(reinterpret_cast<char*>(&info_byte), sizeof(info_byte));
+		auto block = decompress_block(input, info_byte);
+
+		int8_t* values = coefficients.data() + BLOCK_SIZE * BLOCK_SIZE * b;
+		size_t length = 0;
+		for (size_t n = 0; n < BLOCK_SIZE * BLOCK_SIZE; n++)
+		{
+			values[n] = block.data[zig_zag_indices[n].i][zig_zag_indices[n].j];
+			length = values[n] != 0 ? n + 1 : length;
+		}
+
+		info_bytes[b] = static_cast<uint8_t>((info_byte & static_cast<uint8_t>(InfoByte::IsDct)) | length);
+		pass_sizes[0] += 1 + band_span(length, 0);
+		for (size_t pass = 1; pass < PROGRESSIVE_PASSES; pass++)
+		{
+			const size_t span = band_span(length, pass);
+			pass_sizes[pass] += (span + 7) / 8;
+			for (size_t n = 0; n < span; n++)
+			{
+				pass_sizes[pass] += values[PROGRESSIVE_BANDS[pass] + n] != 0 ? 1 : 0;
+			}
+		}
+	}
+
+	if (!input)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not read back the blocks to reorder them" << std::endl;
+		return false;
+	}
+
+	// the header and the tables of the sequential file, then the offset of every pass
+	output.write(&PROGRESSIVE_MAGIC_NUMBER, sizeof(uint32_t));
+	output.write(sequential.data() + sizeof(uint32_t), FILE_PREAMBLE_SIZE - sizeof(uint32_t));
+	output.write(&PROGRESSIVE_PASSES, sizeof(uint32_t));
+
+	uint64_t offset = output.size() + PROGRESSIVE_PASSES * sizeof(uint64_t);
+	for (uint64_t pass_size : pass_sizes)
+	{
+		output.write(&offset, sizeof(uint64_t));
+		offset += pass_size;
+	}
+
+	for (size_t b = 0; b < blocks; b++)
+	{
+		output.write(&info_bytes[b], sizeof(uint8_t));
+		output.write(coefficients.data() + BLOCK_SIZE * BLOCK_SIZE * b,
+		             band_span(info_bytes[b] & PROGRESSIVE_LENGTH_MASK, 0));
+	}
+
+	for (size_t pass = 1; pass < PROGRESSIVE_PASSES; pass++)
+	{
+		for (size_t b = 0; b < blocks; b++)
+		{
+			const size_t span = band_span(info_bytes[b] & PROGRESSIVE_LENGTH_MASK, pass);
+			if (span == 0)
+				continue;
+
+			const int8_t* band = coefficients.data() + BLOCK_SIZE * BLOCK_SIZE * b + PROGRESSIVE_BANDS[pass];
+			uint8_t mask[BLOCK_SIZE] = {};
+			int8_t band_values[BLOCK_SIZE * BLOCK_SIZE];
+			size_t count = 0;
+			for (size_t n = 0; n < span; n++)
+			{
+				if (band[n] != 0)
+				{
+					mask[n / 8] |= static_cast<uint8_t>(1 << (n % 8));
+					band_values[count++] = band[n];
+				}
+			}
+
+			output.write(mask, (span + 7) / 8);
+			output.write(band_values, count);
+		}
+	}
+
+	return output.good();
+}
+
+bool SquashImage::half_size(SquashImage& output) const
+{
+	SQH_TRACE_SCOPE("half_size");
+
+	output.free();
+	output.m_header = m_header;
+	output.m_header.size_x = (m_header.size_x + 1) / 2;
+	output.m_header.size_y = (m_header.size_y + 1) / 2;
+	output.m_data = reinterpret_cast<uint8_t*>(malloc(output.m_header.size_x * output.m_header.size_y * 3));
+
+	auto result = stbir_resize_uint8(m_data, static_cast<int>(m_header.size_x), static_cast<int>(m_header.size_y), 0,
+	                                 output.m_data, static_cast<int>(output.m_header.size_x),
+	                                 static_cast<int>(output.m_header.size_y), 0, 3);
+	if (result == 0)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not downscale the image" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool SquashImage::write_sqh(BlockWriter& output, const EncodeLevel& level, const EncoderOptions& options,
+                            double optimize_time) const
+{
+	if (options.progressive)
+	{
+		if (options.tileSize != 0)
+		{
+			std::cout << "[ERROR] (SquashImage): Progressive files cannot be tiled" << std::endl;
+			return false;
+		}
+
+		// the blocks are encoded as usual, then reordered
+		std::vector<uint8_t> sequential;
+		EncoderOptions sequential_options = options;
+		sequential_options.progressive = false;
+		{
+			BlockWriter sequential_output(sequential);
+			if (!write_sqh(sequential_output, level, sequential_options, optimize_time))
+				return false;
+		}
+
+		auto result = write_progressive(output, sequential) && output.flush();
+		if (options.stats != nullptr)
+			options.stats->totalBytes = output.size();
+
+		return result;
+	}
+
+	std::vector<EncodeStats> stats;
+	auto result = write_sqh({&output}, {level}, options, stats);
+	stats.front().optimizeTime = optimize_time;
+
+	if (options.stats != nullptr)
+		*options.stats = stats.front();
+
+	return result;
+}
+
+bool SquashImage::openTiles(std::string_view file_path, float scale)
+{
+	uint32_t magic_number = 0;
+	uint64_t level_start = 0;
+	if (!open_source(file_path, scale, magic_number, level_start))
+		return false;
+
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
+
+	if (magic_number != TILED_MAGIC_NUMBER)
+	{
+		// the blocks follow the tables, as a single tile covering the whole image
+		m_tileSize = BLOCK_SIZE * std::max({x_blocks, y_blocks, 1u});
+		m_tileOffsets.assign(1, level_start + FILE_PREAMBLE_SIZE);
+		return true;
+	}
+
+	m_sourceFile.read(reinterpret_cast<char*>(&m_tileSize), sizeof(uint32_t));
+	if (m_tileSize == 0 || m_tileSize % BLOCK_SIZE != 0)
+	{
+		std::cout << "[ERROR] (SquashImage): File \"" << file_path << "\" has an invalid tile size" << std::endl;
+		free();
+		return false;
+	}
+
+	m_tileOffsets.resize(static_cast<size_t>(tile_count(x_blocks, m_tileSize)) * tile_count(y_blocks, m_tileSize));
+	m_sourceFile.read(reinterpret_cast<char*>(m_tileOffsets.data()),
+	                static_cast<std::streamsize>(m_tileOffsets.size() * sizeof(uint64_t)));
+
+	if (!m_sourceFile)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not read the tile index of \"" << file_path << "\"" << std::endl;
+		free();
+		return false;
+	}
+
+	for (uint64_t& offset : m_tileOffsets)
+	{
+		offset += level_start;
+	}
+
+	return true;
+}
+
+bool SquashImage::openLazy(std::string_view file_path, size_t cache_bytes, float scale)
+{
+	SQH_TRACE_SCOPE("openLazy");
+
+	uint32_t magic_number = 0;
+	uint64_t level_start = 0;
+	if (!open_source(file_path, scale, magic_number, level_start))
+		return false;
+
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
+
+	uint64_t offset = level_start + FILE_PREAMBLE_SIZE;
+	uint32_t tile_size = 0;
+	m_lazyTileBlocks = std::max(x_blocks, 1u);
+
+	if (magic_number == TILED_MAGIC_NUMBER)
+	{
+		m_sourceFile.read(reinterpret_cast<char*>(&tile_size), sizeof(uint32_t));
+		if (tile_size == 0 || tile_size % BLOCK_SIZE != 0)
+		{
+			std::cout << "[ERROR] (SquashImage): File \"" << file_path << "\" has an invalid tile size" << std::endl;
+			free();
+			return false;
+		}
+
+		// the tiles are stored in order, their offsets are not needed
+		uint64_t tiles = tile_ranges(tile_size).size();
+		m_sourceFile.ignore(static_cast<std::streamsize>(sizeof(uint64_t) * tiles));
+		offset += sizeof(uint32_t) + sizeof(uint64_t) * tiles;
+		m_lazyTileBlocks = tile_size / BLOCK_SIZE;
+	}
+
+	// the offset of every group, from the sizes of the blocks before it. Only the info bytes and the tables are read
+	m_groupOffsets.assign(y_blocks != 0 ? lazy_group(y_blocks - 1, x_blocks - 1).index + 1 : 0, 0);
+
+	for (const BlockRange& tile : tile_ranges(tile_size))
+	{
+		for (uint32_t i = tile.firstRow; i < tile.endRow; i++)
+		{
+			for (uint32_t j = tile.firstColumn; j < tile.endColumn; j++)
+			{
+				auto group = lazy_group(i, j);
+				if (group.firstColumn == j)
+					m_groupOffsets[group.index] = offset;
+
+				for (int c = 0; c < 3; c++)
+				{
+					uint8_t info_byte = 0;
+					m_sourceFile.read(reinterpret_cast<char*>(&info_byte), sizeof(info_byte));
+
+					size_t data_size = info_byte & 0x3F;
+					if (info_byte & static_cast<uint8_t>(InfoByte::IsLong))
+					{
+						uint64_t table = 0;
+						m_sourceFile.read(reinterpret_cast<char*>(&table), sizeof(table));
+						data_size = sizeof(table) + set_bits(table);
+						m_sourceFile.ignore(static_cast<std::streamsize>(set_bits(table)));
+					}
+					else
+					{
+						m_sourceFile.ignore(static_cast<std::streamsize>(data_size));
+					}
+
+					offset += sizeof(info_byte) + data_size;
+				}
+			}
+		}
+	}
+
+	if (!m_sourceFile)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not read the blocks of \"" << file_path << "\"" << std::endl;
+		free();
+		return false;
+	}
+
+	m_groupCacheCapacity = std::max<size_t>(1, cache_bytes / LAZY_GROUP_BYTES);
+	return true;
+}
+
+bool SquashImage::getPixel(uint32_t x, uint32_t y, uint8_t* rgb)
+{
+	if (x >= m_header.size_x || y >= m_header.size_y)
+	{
+		std::cout << "[ERROR] (SquashImage): Pixel (" << x << ", " << y << ") is not inside the image" << std::endl;
+		return false;
+	}
+
+	if (m_data != nullptr)
+	{
+		std::memcpy(rgb, m_data + 3 * (static_cast<size_t>(m_header.size_x) * y + x), 3);
+		return true;
+	}
+
+	if (m_groupOffsets.empty())
+	{
+		std::cout << "[ERROR] (SquashImage): No image is decoded or opened with openLazy()" << std::endl;
+		return false;
+	}
+
+	auto group = lazy_group(y / BLOCK_SIZE, x / BLOCK_SIZE);
+	const uint8_t* pixels = cached_group(y / BLOCK_SIZE, group);
+	if (pixels == nullptr)
+		return false;
+
+	std::memcpy(rgb, pixels + LAZY_GROUP_STRIDE * (y % BLOCK_SIZE) + 3 * (x - BLOCK_SIZE * group.firstColumn), 3);
+	return true;
+}
+
+bool SquashImage::getRow(uint32_t y, uint8_t* output)
+{
+	if (y >= m_header.size_y)
+	{
+		std::cout << "[ERROR] (SquashImage): Row " << y << " is not inside the image" << std::endl;
+		return false;
+	}
+
+	if (m_data != nullptr)
+	{
+		std::memcpy(output, m_data + 3 * static_cast<size_t>(m_header.size_x) * y, 3 * static_cast<size_t>(m_header.size_x));
+		return true;
+	}
+
+	if (m_groupOffsets.empty())
+	{
+		std::cout << "[ERROR] (SquashImage): No image is decoded or opened with openLazy()" << std::endl;
+		return false;
+	}
+
+	uint32_t x_blocks = block_count(m_header.size_x);
+	for (uint32_t j = 0; j < x_blocks; )
+	{
+		auto group = lazy_group(y / BLOCK_SIZE, j);
+		const uint8_t* pixels = cached_group(y / BLOCK_SIZE, group);
+		if (pixels == nullptr)
+			return false;
+
+		uint32_t x0 = BLOCK_SIZE * group.firstColumn;
+		uint32_t x1 = std::min<uint32_t>(BLOCK_SIZE * group.endColumn, m_header.size_x);
+		std::memcpy(output + 3 * static_cast<size_t>(x0), pixels + LAZY_GROUP_STRIDE * (y % BLOCK_SIZE), 3 * (x1 - x0));
+
+		j = group.endColumn;
+	}
+
+	return true;
+}
+
+bool SquashImage::decodeRegion(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t* output,
+                               size_t output_stride)
+{
+	SQH_TRACE_SCOPE("decodeRegion");
+
+	if (m_tileOffsets.empty())
+	{
+		std::cout << "[ERROR] (SquashImage): No file is open for decodeRegion(), see openTiles()" << std::endl;
+		return false;
+	}
+
+	if (static_cast<uint64_t>(x) + width > m_header.size_x || static_cast<uint64_t>(y) + height > m_header.size_y)
+	{
+		std::cout << "[ERROR] (SquashImage): The region " << width << "x" << height << " at (" << x << ", " << y
+		          << ") is not inside the image" << std::endl;
+		return false;
+	}
+
+	if (width == 0 || height == 0)
+		return true;
+
+	RegionOutput region{output, output_stride != 0 ? output_stride : 3 * static_cast<size_t>(width),
+	                    x, y, x + width, y + height};
+
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
+	uint32_t x_tiles = tile_count(x_blocks, m_tileSize);
+	uint32_t tile_blocks = m_tileSize / BLOCK_SIZE;
+
+	for (uint32_t tile_y = y / m_tileSize; tile_y <= (y + height - 1) / m_tileSize; tile_y++)
+	{
+		for (uint32_t tile_x = x / m_tileSize; tile_x <= (x + width - 1) / m_tileSize; tile_x++)
+		{
+			BlockRange tile{tile_blocks * tile_y, std::min(tile_blocks * (tile_y + 1), y_blocks),
+			                tile_blocks * tile_x, std::min(tile_blocks * (tile_x + 1), x_blocks)};
+
+			m_sourceFile.seekg(static_cast<std::streamoff>(m_tileOffsets[static_cast<size_t>(tile_y) * x_tiles + tile_x]));
+			decompress_blocks(m_sourceFile, tile, region);
+		}
+	}
+
+	if (!m_sourceFile)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not read the tiles of the region" << std::endl;
+		m_sourceFile.clear();
+		return false;
+	}
+
+	return true;
+}
+
+uint8_t* SquashImage::getData()
+{
+	return m_data;
+}
+
+const SquashHeader& SquashImage::getHeader()
+{
+	return m_header;
+}
+
+const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& SquashImage::getDCTQTable() const
+{
+	return m_dctQTable;
+}
+
+const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& SquashImage::getHaarQTable() const
+{
+	return m_haarQTable;
+}
+
+bool SquashImage::loadQTables(std::string_view profile_path)
+{
+	QTableProfile profile;
+	if (!profile.open(profile_path))
+		return false;
+
+	setQTables(profile.dctTable, profile.haarTable);
+	return true;
+}
+
+void SquashImage::setQTables(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& dct_table,
+                             const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& haar_table)
+{
+	m_dctQTable = dct_table;
+	m_haarQTable = haar_table;
+	m_dctQReciprocal = reciprocal(m_dctQTable);
+	m_haarQReciprocal = reciprocal(m_haarQTable);
+}
+
+math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> SquashImage::scaleQTable(
+	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& table, float scale)
+{
+	return (table * scale + 0.5f).floor().clamp(1.f, 255.f);
+}
+
+uint64_t SquashImage::preamble_size(const EncoderOptions& options) const
+{
+	// the number of passes and their offsets
+	if (options.progressive)
+		return FILE_PREAMBLE_SIZE + sizeof(uint32_t) + PROGRESSIVE_PASSES * sizeof(uint64_t);
+
+	// smaller tile sizes are rejected by the encoder
+	if (options.tileSize < BLOCK_SIZE)
+		return FILE_PREAMBLE_SIZE;
+
+	// the tile size and the offset of every tile
+	uint64_t tiles = static_cast<uint64_t>(tile_count(block_count(m_header.size_x), options.tileSize))
+	                 * tile_count(block_count(m_header.size_y), options.tileSize);
+	return FILE_PREAMBLE_SIZE + sizeof(uint32_t) + tiles * sizeof(uint64_t);
+}
+
+bool SquashImage::open_source(std::string_view file_path, float scale, uint32_t& magic_number, uint64_t& level_start)
+{
+	free();
+
+	m_sourceFile.open(std::string(file_path), std::ios::binary);
+
+	if (!read_preamble(m_sourceFile, file_path, magic_number))
+	{
+		m_sourceFile.close();
+		return false;
+	}
+
+	// the offsets in a level of a pyramid are from the start of the level
+	level_start = 0;
+	if (magic_number == PYRAMID_MAGIC_NUMBER)
+	{
+		if (!seek_pyramid_level(m_sourceFile, scale))
+		{
+			free();
+			return false;
+		}
+
+		level_start = static_cast<uint64_t>(m_sourceFile.tellg());
+		if (!read_preamble(m_sourceFile, file_path, magic_number) || magic_number == PYRAMID_MAGIC_NUMBER)
+		{
+			free();
+			return false;
+		}
+	}
+
+	if (magic_number == PROGRESSIVE_MAGIC_NUMBER)
+	{
+		std::cout << "[ERROR] (SquashImage): File \"" << file_path << "\" is progressive, its blocks cannot be read "
+		          << "one at a time" << std::endl;
+		free();
+		return false;
+	}
+
+	return true;
+}
+
+std::vector<SquashImage::BlockRange> SquashImage::tile_ranges(uint32_t tile_size) const
+{
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
+
+	if (tile_size == 0)
+		return {{0, y_blocks, 0, x_blocks}};
+
+	std::vector<BlockRange> tiles;
+	uint32_t tile_blocks = tile_size / BLOCK_SIZE;
+	for (uint32_t tile_y = 0; tile_y < tile_count(y_blocks, tile_size); tile_y++)
+	{
+		for (uint32_t tile_x = 0; tile_x < tile_count(x_blocks, tile_size); tile_x++)
+		{
+			tiles.push_back({tile_blocks * tile_y, std::min(tile_blocks * (tile_y + 1), y_blocks),
+			                 tile_blocks * tile_x, std::min(tile_blocks * (tile_x + 1), x_blocks)});
+		}
+	}
+
+	return tiles;
+}
+
+SquashImage::LazyGroup SquashImage::lazy_group(uint32_t block_y, uint32_t block_x) const
+{
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t tile = block_x / m_lazyTileBlocks;
+	uint32_t tile_start = tile * m_lazyTileBlocks;
+	uint32_t group = (block_x - tile_start) / LAZY_GROUP_BLOCKS;
+
+	// the last tile of a row may be narrower, with fewer groups
+	size_t tile_groups = (m_lazyTileBlocks + LAZY_GROUP_BLOCKS - 1) / LAZY_GROUP_BLOCKS;
+	size_t row_groups = (x_blocks / m_lazyTileBlocks) * tile_groups
+	                    + (x_blocks % m_lazyTileBlocks + LAZY_GROUP_BLOCKS - 1) / LAZY_GROUP_BLOCKS;
+
+	LazyGroup result;
+	result.index = row_groups * block_y + tile_groups * tile + group;
+	result.firstColumn = tile_start + LAZY_GROUP_BLOCKS * group;
+	result.endColumn = std::min({result.firstColumn + LAZY_GROUP_BLOCKS, tile_start + m_lazyTileBlocks, x_blocks});
+	return result;
+}
+
+const uint8_t* SquashImage::cached_group(uint32_t block_y, const LazyGroup& group)
+{
+	auto found = m_groupCacheIndex.find(group.index);
+	if (found != m_groupCacheIndex.end())
+	{
+		m_groupCache.splice(m_groupCache.begin(), m_groupCache, found->second);
+		return m_groupCache.front().second.data();
+	}
+
+	SQH_TRACE_SCOPE("decode group");
+
+	// a full cache gives the pixels of its least recently used group
+	if (m_groupCache.size() >= m_groupCacheCapacity)
+	{
+		m_groupCacheIndex.erase(m_groupCache.back().first);
+		m_groupCache.splice(m_groupCache.begin(), m_groupCache, std::prev(m_groupCache.end()));
+	}
+	else
+	{
+		m_groupCache.emplace_front(0, std::vector<uint8_t>(LAZY_GROUP_BYTES));
+	}
+
+	auto& entry = m_groupCache.front();
+	RegionOutput output{entry.second.data(), LAZY_GROUP_STRIDE,
+	                    static_cast<uint32_t>(BLOCK_SIZE * group.firstColumn), static_cast<uint32_t>(BLOCK_SIZE * block_y),
+	                    std::min<uint32_t>(BLOCK_SIZE * group.endColumn, m_header.size_x),
+	                    std::min<uint32_t>(BLOCK_SIZE * (block_y + 1), m_header.size_y)};
+
+	m_sourceFile.seekg(static_cast<std::streamoff>(m_groupOffsets[group.index]));
+	decompress_blocks(m_sourceFile, {block_y, block_y + 1, group.firstColumn, group.endColumn}, output);
+
+	if (!m_sourceFile)
+	{
+		std::cout << "[ERROR] (SquashImage): Could not read the blocks at (" << group.firstColumn << ", " << block_y
+		          << ")" << std::endl;
+		m_sourceFile.clear();
+		m_groupCache.pop_front();
+		return nullptr;
+	}
+
+	entry.first = group.index;
+	m_groupCacheIndex[group.index] = m_groupCache.begin();
+	return entry.second.data();
+}
+
+SquashImage::EncodeLevel SquashImage::base_level(const EncoderOptions& options) const
+{
+	if (options.optimizeQTables)
+		return findOptimalQTables(make_level(m_dctQTable, m_haarQTable), options);
+
+	return {m_dctQTable, m_haarQTable, m_dctQReciprocal, m_haarQReciprocal};
+}
+
+void SquashImage::free()
+{
+	::free(m_data);
+	m_data = nullptr;
+
+	m_planes.clear();
+	m_planes.shrink_to_fit();
+	m_planeStride = 0;
+	m_planeRows = 0;
+
+	m_sourceFile.close();
+	m_tileSize = 0;
+	m_tileOffsets.clear();
+
+	m_lazyTileBlocks = 0;
+	m_groupOffsets.clear();
+	m_groupCache.clear();
+	m_groupCacheIndex.clear();
+	m_groupCacheCapacity = 0;
+}
+
+void SquashImage::build_planes() const
+{
+	std::lock_guard<std::mutex> lock(m_planesMutex);
+	if (!m_planes.empty() || m_data == nullptr)
+		return;
+
+	m_planeStride = BLOCK_SIZE * block_count(m_header.size_x);
+	m_planeRows   = BLOCK_SIZE * block_count(m_header.size_y);
+	m_planes.assign(3 * m_planeStride * m_planeRows, PADDING_VALUE);
+
+	const size_t plane_size = m_planeStride * m_planeRows;
+	uint8_t* planes[3] = {m_planes.data(), m_planes.data() + plane_size, m_planes.data() + 2 * plane_size};
+
+	for (size_t y = 0; y < m_header.size_y; y++)
+	{
+		const uint8_t* source = m_data + 3 * m_header.size_x * y;
+		const size_t row_offset = m_planeStride * y;
+
+		for (size_t x = 0; x < m_header.size_x; x++)
+		{
+			planes[0][row_offset + x] = source[3 * x + 0];
+			planes[1][row_offset + x] = source[3 * x + 1];
+			planes[2][row_offset + x] = source[3 * x + 2];
+		}
+	}
+}
+
+math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> SquashImage::load_block(
+	uint32_t block_y, uint32_t block_x, size_t channel) const
+{
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> block;
+
+	const uint8_t* source = m_planes.data() + channel * m_planeStride * m_planeRows
+	                        + BLOCK_SIZE * (m_planeStride * block_y + block_x);
+
+	// each block row is a contiguous run of BLOCK_SIZE bytes in the plane
+	for (size_t k = 0; k < BLOCK_SIZE; k++)
+	{
+		std::memcpy(block.data[k], source + m_planeStride * k, BLOCK_SIZE);
+	}
+
+	return block;
+}
+
+const BlockTransform& SquashImage::dct_transform()
+{
+	return DCT_TRANSFORM;
+}
+
+const BlockTransform& SquashImage::haar_transform()
+{
+	return HAAR_TRANSFORM;
+}
+
+math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t> SquashImage::transform_block(
+	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> &block,
+    const BlockTransform &transform,
+    const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> &quantization_reciprocal,
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>* coefficients)
+{
+	auto transformed_data = forward_transform(block, transform);
+	if (coefficients != nullptr)
 		*coefficients = transformed_data;
 
-	// AKA l
-	auto quantized_data = (transformed_data / quantization_matrix) + 0.5f;
-	return quantized_data.asType<int8_t>([](float input) {
-		return static_cast<int8_t>(std::floorf(input));
-	});
-}
+	return quantize(transformed_data, quantization_reciprocal);
+}
+
+math::Matrix<8, 8, uint8_t> SquashImage::inverse_transform_block(
+	std::istream &input_file, uint8_t info_byte,
+    const BlockTransform &transform,
+    const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> &quantization_matrix)
+{
+	auto block = decompress_block(input_file, info_byte);
+
+	return test_inverse_transform_block(block, transform, quantization_matrix, coefficient_count(info_byte));
+}
+
+math::Matrix<8, 8, uint8_t> SquashImage::test_inverse_transform_block(
+	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>& input_block,
+	const BlockTransform& transform,
+	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& quantization_matrix,
+	size_t coefficient_count)
+{
+	if (coefficient_count <= 1)
+	{
+		// DC only: every pixel gets the same value
+		float beta = static_cast<float>(input_block.data[0][0]) * quantization_matrix.data[0][0];
+		float f_bar = transform.transposed.data[0][0] * (beta * transform.matrix.data[0][0]) + 128.f;
+		auto value = static_cast<uint8_t>(std::min(255.f, std::max(0.f, std::floor(f_bar))));
+
+		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> block;
+		std::memset(block.data, value, sizeof(block.data));
+		return block;
+	}
+
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> beta = input_block.cast<float>() * quantization_matrix;
+
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> f_bar;
+	if (coefficient_count <= SPARSE_COEFFICIENTS)
+		f_bar = inverse_kernel<SPARSE_EXTENT>(beta, transform);
+	else
+		f_bar = inverse_kernel<BLOCK_SIZE>(beta, transform);
+
+	return (f_bar + 128.f).floor().clamp(0.f, 255.f).cast<uint8_t>();
+}
+
+void SquashImage::compress_block(
+	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>& block_data, CompressedBlock& compressed_block,
+	bool isHaar)
+{
+	compressed_block.infoByte = isHaar ? 0 : static_cast<uint8_t>(InfoByte::IsDct);
+	compressed_block.table = 0;
+
+	const int8_t* raster_data = &block_data.data[0][0];
+
+	// STEP 1: try short with zig-zag
+	alignas(16) int8_t zig_zag_data[BLOCK_SIZE * BLOCK_SIZE];
+	zig_zag_permute(raster_data, zig_zag_data);
+
+	// everything after the last non-zero coefficient is dropped, the zeros before it have to be stored
+	uint64_t zig_zag_mask = nonzero_mask(zig_zag_data);
+	size_t usedCount = zig_zag_mask == 0 ? 0 : 64 - leading_zeros(zig_zag_mask);
+	size_t extraZeros = usedCount - set_bits(zig_zag_mask);
+
+	// a full block would need 64 in the 6 bits of the count (setting the IsLong bit), it is stored long
+	if (extraZeros <= 8 && usedCount < BLOCK_SIZE * BLOCK_SIZE)
+	{
+		// use short representation
+		auto dataCount = static_cast<uint8_t>(usedCount);
+		compressed_block.infoByte |= dataCount;
+		compressed_block.dataCount = dataCount;
+		std::memcpy(compressed_block.data, zig_zag_data, dataCount);
+
+		return;
+	}
+
+	compressed_block.infoByte |= static_cast<uint8_t>(InfoByte::IsLong);
+
+	// the table stores the first raster position in its highest bit
+	uint64_t raster_mask = nonzero_mask(raster_data);
+	compressed_block.table = reverse_bits(raster_mask);
+	compressed_block.dataCount = static_cast<uint8_t>(compress_store(raster_data, raster_mask, compressed_block.data));
+}
+
+const char* SquashImage::packing_path()
+{
+#if defined(SQH_SSSE3_DISPATCH)
+	return HAS_SSSE3 ? "SSSE3 (runtime dispatch)" : "scalar (no SSSE3 on this CPU)";
+#elif defined(SQH_SSSE3)
+	return "SSSE3";
+#else
+	return "scalar";
+#endif
+}
+
+math::Matrix<8, 8, int8_t> SquashImage::decompress_block(
+	std::istream &input_file, uint8_t infoByte)
+{
+	math::Matrix<8, 8, int8_t> m;
+	int8_t values[BLOCK_SIZE * BLOCK_SIZE];
+
+	if (infoByte & static_cast<uint8_t>(InfoByte::IsLong))
+	{
+		// long block
+		uint64_t table;
+		input_file.read(reinterpret_cast<char*>(&table), sizeof(table));
+
+		// the values of all set bits follow the table, in order
+		input_file.read(reinterpret_cast<char*>(values), static_cast<std::streamsize>(set_bits(table)));
+
+		// the first raster position is the highest bit, so only visit set bits from the top
+		size_t count = 0;
+		while (table != 0)
+		{
+			size_t position = leading_zeros(table);
+			m.data[position / BLOCK_SIZE][position % BLOCK_SIZE] = values[count++];
+			table &= ~(TABLE_BITMASK >> position);
+		}
+
+		return m;
+	}
+
+	// short block
+	uint8_t data_count = infoByte & 0x3F; // 63 (so all ones except the first two)
+	input_file.read(reinterpret_cast<char*>(values), data_count);
+
+	for (int i = 0; i < data_count; i++)
+	{
+		auto index = zig_zag_indices[i];
+		m.data[index.i][index.j] = values[i];
+	}
+
+	return m;
+}
+
+bool SquashImage::decompress(std::istream &input_file)
+{
+	SQH_TRACE_SCOPE("decompress");
+
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
+
+	free();
+	m_data = reinterpret_cast<uint8_t*>(malloc(m_header.size_x * m_header.size_y * 3));
+
+	decompress_blocks(input_file, {0, y_blocks, 0, x_blocks},
+	                  {m_data, 3 * static_cast<size_t>(m_header.size_x), 0, 0, m_header.size_x, m_header.size_y});
+
+	return true;
+}
+
+bool SquashImage::decompress_tiles(std::istream& input_file)
+{
+	SQH_TRACE_SCOPE("decompress tiles");
+
+	uint32_t tile_size = 0;
+	input_file.read(reinterpret_cast<char*>(&tile_size), sizeof(uint32_t));
+	if (tile_size == 0 || tile_size % BLOCK_SIZE != 0)
+	{
+		std::cout << "[ERROR] (SquashImage): Invalid tile size: " << tile_size << std::endl;
+		return false;
+	}
+
+	std::vector<BlockRange> tiles = tile_ranges(tile_size);
+
+	// the tiles are stored in order, the index is not needed to decode all of them
+	input_file.ignore(static_cast<std::streamsize>(sizeof(uint64_t) * tiles.size()));
+
+	free();
+	m_data = reinterpret_cast<uint8_t*>(malloc(m_header.size_x * m_header.size_y * 3));
+	RegionOutput image{m_data, 3 * static_cast<size_t>(m_header.size_x), 0, 0, m_header.size_x, m_header.size_y};
+
+	for (const BlockRange& tile : tiles)
+	{
+		decompress_blocks(input_file, tile, image);
+	}
+
+	return true;
+}
+
+bool SquashImage::decompress_progressive(std::istream& input_file)
+{
+	SQH_TRACE_SCOPE("decompress progressive");
+
+	uint32_t pass_count = 0;
+	input_file.read(reinterpret_cast<char*>(&pass_count), sizeof(uint32_t));
+	if (pass_count != PROGRESSIVE_PASSES)
+	{
+		std::cout << "[ERROR] (SquashImage): Invalid number of progressive passes: " << pass_count << std::endl;
+		return false;
+	}
+
+	// the passes are stored in order, the index is not needed to read them
+	input_file.ignore(static_cast<std::streamsize>(sizeof(uint64_t) * pass_count));
+
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
+	const size_t blocks = 3 * static_cast<size_t>(x_blocks) * y_blocks;
+
+	// a file which was cut short keeps the coefficients read so far, the others are zeros
+	std::vector<uint8_t> info_bytes(blocks);
+	std::vector<int8_t> coefficients(blocks * BLOCK_SIZE * BLOCK_SIZE);
+
+	for (size_t b = 0; b < blocks && input_file; b++)
+	{
+		input_file.read(reinterpret_cast<char*>(&info_bytes[b]), sizeof(uint8_t));
+		input_file.read(reinterpret_cast<char*>(coefficients.data() + BLOCK_SIZE * BLOCK_SIZE * b),
+		                static_cast<std::streamsize>(band_span(info_bytes[b] & PROGRESSIVE_LENGTH_MASK, 0)));
+	}
+
+	for (size_t pass = 1; pass < PROGRESSIVE_PASSES && input_file; pass++)
+	{
+		for (size_t b = 0; b < blocks && input_file; b++)
+		{
+			const size_t span = band_span(info_bytes[b] & PROGRESSIVE_LENGTH_MASK, pass);
+			if (span == 0)
+				continue;
+
+			uint8_t mask[BLOCK_SIZE] = {};
+			int8_t band_values[BLOCK_SIZE * BLOCK_SIZE];
+			input_file.read(reinterpret_cast<char*>(mask), static_cast<std::streamsize>((span + 7) / 8));
+
+			size_t count = 0;
+			for (size_t n = 0; n < span; n++)
+			{
+				count += (mask[n / 8] >> (n % 8)) & 1;
+			}
+			input_file.read(reinterpret_cast<char*>(band_values), static_cast<std::streamsize>(count));
+
+			int8_t* band = coefficients.data() + BLOCK_SIZE * BLOCK_SIZE * b + PROGRESSIVE_BANDS[pass];
+			for (size_t n = 0, k = 0; n < span && k < static_cast<size_t>(input_file.gcount()); n++)
+			{
+				if ((mask[n / 8] >> (n % 8)) & 1)
+					band[n] = band_values[k++];
+			}
+		}
+	}
+
+	free();
+	m_data = reinterpret_cast<uint8_t*>(malloc(m_header.size_x * m_header.size_y * 3));
+	RegionOutput image{m_data, 3 * static_cast<size_t>(m_header.size_x), 0, 0, m_header.size_x, m_header.size_y};
 
-math::Matrix<8, 8, uint8_t> SquashImage::inverse_transform_block(
-	std::ifstream &input_file, uint8_t info_byte,
-    const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> &transform_matrix,
-    const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> &quantization_matrix)
-{
-	auto block = decompress_block(input_file, info_byte);
+	size_t b = 0;
+	for (uint32_t i = 0; i < y_blocks; i++) {
+		for (uint32_t j = 0; j < x_blocks; j++) {
+			for (size_t c = 0; c < 3; c++, b++) {
+				const int8_t* values = coefficients.data() + BLOCK_SIZE * BLOCK_SIZE * b;
+				size_t length = info_bytes[b] & PROGRESSIVE_LENGTH_MASK;
 
-	auto beta = (block.asType<float>() * quantization_matrix);
+				math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t> block;
+				for (size_t n = 0; n < length; n++)
+				{
+					block.data[zig_zag_indices[n].i][zig_zag_indices[n].j] = values[n];
+				}
 
-	auto f_bar = transform_matrix.transpose().product(beta.product(transform_matrix)) + 128.f;
-	return f_bar.asType<uint8_t>([](float input) {
-		return static_cast<uint8_t>(std::min(255.f, std::max(0.f, floorf(input))));
-	});
+				// the coefficients past length are zeros, the reduced transforms give the same pixels
+				math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> f_bar;
+				if (info_bytes[b] & static_cast<uint8_t>(InfoByte::IsDct))
+					f_bar = test_inverse_transform_block(block, DCT_TRANSFORM, m_dctQTable, length);
+				else
+					f_bar = test_inverse_transform_block(block, HAAR_TRANSFORM, m_haarQTable, length);
+
+				store_block(f_bar, i, j, c, image);
+			}
+		}
+	}
+
+	return true;
 }
 
-math::Matrix<8, 8, uint8_t> SquashImage::test_inverse_transform_block(
-	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>& input_block,
-	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& transform_matrix,
-	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& quantization_matrix)
+void SquashImage::decompress_blocks(std::istream& input_file, const BlockRange& range,
+                                    const RegionOutput& output) const
 {
-	auto beta = (input_block.asType<float>() * quantization_matrix);
+	for (uint32_t i = range.firstRow; i < range.endRow; i++) {
+		// one band is a row of blocks
+		SQH_TRACE_SCOPE("decompress band");
 
-	auto f_bar = transform_matrix.transpose().product(beta.product(transform_matrix)) + 128.f;
-	return f_bar.asType<uint8_t>([](float input) {
-		return static_cast<uint8_t>(std::min(255.f, std::max(0.f, floorf(input))));
-	});
+		// rows of the block which are in the output
+		uint32_t y_begin = std::max<uint32_t>(BLOCK_SIZE * i, output.y0);
+		uint32_t y_end = std::min<uint32_t>(BLOCK_SIZE * (i + 1), output.y1);
+
+		for (uint32_t j = range.firstColumn; j < range.endColumn; j++) {
+			uint32_t x_begin = std::max<uint32_t>(BLOCK_SIZE * j, output.x0);
+			uint32_t x_end = std::min<uint32_t>(BLOCK_SIZE * (j + 1), output.x1);
+			const bool visible = y_begin < y_end && x_begin < x_end;
+
+			for (int c = 0; c < 3; c++) {
+				uint8_t info_byte = 0;
+				input_file.read(reinterpret_cast<char*>(&info_byte), sizeof(info_byte));
+
+				if (!visible)
+				{
+					// read to get to the next block, but never transformed
+					decompress_block(input_file, info_byte);
+					continue;
+				}
+
+				math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> f_bar;
+
+				if (info_byte & static_cast<uint8_t>(InfoByte::IsDct))
+				{
+					// DCT
+					f_bar = inverse_transform_block(input_file, info_byte, DCT_TRANSFORM, m_dctQTable);
+				}
+				else
+				{
+					// HAAR
+					f_bar = inverse_transform_block(input_file, info_byte, HAAR_TRANSFORM, m_haarQTable);
+				}
+
+				store_block(f_bar, i, j, c, output);
+			}
+		}
+	}
 }
 
-void SquashImage::compress_block(
-	const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, int8_t>& block_data, CompressedBlock& compressed_block,
-	bool isHaar)
+void SquashImage::store_block(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& f_bar, uint32_t block_y,
+                              uint32_t block_x, size_t channel, const RegionOutput& output)
 {
-	compressed_block.infoByte = isHaar ? 0 : static_cast<uint8_t>(InfoByte::IsDct);
+	uint32_t y_begin = std::max<uint32_t>(BLOCK_SIZE * block_y, output.y0);
+	uint32_t y_end = std::min<uint32_t>(BLOCK_SIZE * (block_y + 1), output.y1);
+	uint32_t x_begin = std::max<uint32_t>(BLOCK_SIZE * block_x, output.x0);
+	uint32_t x_end = std::min<uint32_t>(BLOCK_SIZE * (block_x + 1), output.x1);
 
-	// STEP 1: try short with zig-zag
-	auto zig_zag_data = block_data.flatten(zig_zag_flatten);
-	size_t endZerosCount = 0;
-	int index = zig_zag_data.size() - 1;
-	while (index >= 0 && zig_zag_data[index] == 0)
-	{
-		endZerosCount++;
-		index--;
-	}
+	for (uint32_t y = y_begin; y < y_end; y++) {
+		const uint8_t* source = f_bar.data[y - BLOCK_SIZE * block_y] + (x_begin - BLOCK_SIZE * block_x);
+		uint8_t* destination = output.data + output.stride * (y - output.y0) + 3 * (x_begin - output.x0) + channel;
 
-	size_t extraZeros = 0;
-	while (index >= 0)
-	{
-		if (zig_zag_data[index] == 0)
-		{
-			extraZeros++;
+		for (uint32_t x = x_begin; x < x_end; x++) {
+			destination[3 * (x - x_begin)] = source[x - x_begin];
 		}
-		index--;
 	}
+}
 
-	if (extraZeros <= 8)
-	{
-		// use short representation
-		auto dataCount = static_cast<uint8_t>(64 - endZerosCount); // TODO: careful here! If the block is completely full, this will lead to problems...
-		compressed_block.infoByte |= dataCount;
-		compressed_block.table = 0;
-		compressed_block.dataCount = dataCount;
+bool SquashImage::compress(const std::vector<BlockWriter*>& outputs, const std::vector<EncodeLevel>& levels,
+                           const EncoderOptions& options, std::vector<EncodeStats>& stats) const
+{
+	SQH_TRACE_SCOPE("compress");
 
-		for (uint8_t i = 0; i < dataCount; i++)
-		{
-			compressed_block.data[i] = zig_zag_data[i];
-		}
+	build_planes();
 
-		return;
+	for (size_t level = 0; level < levels.size(); level++)
+	{
+		auto Q_haar_data = levels[level].haarTable.asType<uint8_t>().flatten<raster_indices>();
+		auto Q_dct_data = levels[level].dctTable.asType<uint8_t>().flatten<raster_indices>();
+		outputs[level]->write(Q_dct_data.data(), BLOCK_SIZE * BLOCK_SIZE);
+		outputs[level]->write(Q_haar_data.data(), BLOCK_SIZE * BLOCK_SIZE);
 	}
 
-	compressed_block.infoByte |= static_cast<uint8_t>(InfoByte::IsLong);
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
 
-	// we could store this in zig-zag to avoid recomputing but whatever
-	auto horizontal_data = block_data.flatten(flatten_horiz);
+	unsigned int thread_count = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	auto start = Clock::now();
 
-	for (auto value : horizontal_data)
+	// the tiles, or the bands of rows the threads share
+	std::vector<BlockRange> parts;
+	if (options.tileSize != 0)
 	{
-		// shifting the first doesn't do anything
-		compressed_block.table <<= 1;
-
-		if (value != 0)
+		parts = tile_ranges(options.tileSize);
+	}
+	else if (thread_count > 1)
+	{
+		size_t band_count = std::min<size_t>(y_blocks, BANDS_PER_THREAD * thread_count);
+		for (size_t band = 0; band < band_count; band++)
 		{
-			compressed_block.data[compressed_block.dataCount++] = value;
-			compressed_block.table |= 1; // append a one at the end of the table, representing the value
+			parts.push_back({static_cast<uint32_t>(y_blocks * band / band_count),
+			                 static_cast<uint32_t>(y_blocks * (band + 1) / band_count), 0, x_blocks});
 		}
 	}
-}
 
-math::Matrix<8, 8, int8_t> SquashImage::decompress_block(
-	std::ifstream &input_file, uint8_t infoByte)
-{
-	math::Matrix<8, 8, int8_t> m;
-
-	if (infoByte & static_cast<uint8_t>(InfoByte::IsLong))
+	if (parts.empty())
 	{
-		// long block
-		uint64_t table;
-		input_file.read(reinterpret_cast<char*>(&table), sizeof(table));
-
-		for (int k = 0; k < 64; k++)
-		{
+		compress_blocks({0, y_blocks, 0, x_blocks}, outputs, levels, options, stats.data());
+	}
+	else
+	{
+		// every part is encoded into its own buffers (one per level), and the buffers are written in order: the files
+		// are the same as with a single thread
+		std::vector<std::vector<uint8_t>> part_data(parts.size() * levels.size());
+		std::vector<EncodeStats> part_stats(parts.size() * levels.size());
+
+		for_each_parallel(parts.size(), thread_count, [&](size_t part) {
+			// parts are small, a full sized buffer per part is not needed
+			std::vector<std::unique_ptr<BlockWriter>> part_outputs;
+			std::vector<BlockWriter*> part_output_pointers;
+			for (size_t level = 0; level < levels.size(); level++)
+			{
+				part_outputs.push_back(std::make_unique<BlockWriter>(part_data[part * levels.size() + level], 64 * 1024));
+				part_output_pointers.push_back(part_outputs.back().get());
+			}
 
-			auto index = std::div(k, 8);
+			compress_blocks(parts[part], part_output_pointers, levels, options,
+			                part_stats.data() + part * levels.size());
 
-			if (!(table & TABLE_BITMASK))
+			for (auto& part_output : part_outputs)
 			{
-				m.data[index.quot][index.rem] = 0;
+				part_output->flush();
 			}
-			else
+		});
+
+		if (options.tileSize != 0)
+		{
+			// the tile size and the offset of every tile in the file
+			for (size_t level = 0; level < levels.size(); level++)
 			{
-				int8_t value;
-				input_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-				m.data[index.quot][index.rem] = value;
-			}
+				outputs[level]->write(&options.tileSize, sizeof(uint32_t));
 
-			table <<= 1;
+				uint64_t offset = outputs[level]->size() + parts.size() * sizeof(uint64_t);
+				for (size_t part = 0; part < parts.size(); part++)
+				{
+					outputs[level]->write(&offset, sizeof(uint64_t));
+					offset += part_data[part * levels.size() + level].size();
+				}
+			}
 		}
 
-		return m;
+		for (size_t part = 0; part < parts.size(); part++)
+		{
+			for (size_t level = 0; level < levels.size(); level++)
+			{
+				const auto& data = part_data[part * levels.size() + level];
+				outputs[level]->write(data.data(), data.size());
+				add_stats(stats[level], part_stats[part * levels.size() + level]);
+			}
+		}
 	}
 
-	// short block
-	uint8_t data_count = infoByte & 0x3F; // 63 (so all ones except the first two)
-	for (int i = 0; i < data_count; i++)
+	bool result = true;
+	for (size_t level = 0; level < levels.size(); level++)
 	{
-		int8_t value;
-		input_file.read(reinterpret_cast<char*>(&value), sizeof(value));
+		// shared by all levels, as the blocks of every level are encoded together
+		stats[level].blocksTime = elapsed_ms(start);
+		stats[level].averageQuality /= static_cast<float>(y_blocks) * static_cast<float>(x_blocks) * 3.f;
+		stats[level].requestedQuality = options.quality;
 
-		auto index = zig_zag_flatten(i);
-		m.data[index.i][index.j] = value;
+		result = outputs[level]->good() && result;
 	}
 
-	return m;
+	return result;
 }
 
-bool SquashImage::decompress(std::ifstream &input_file)
+void SquashImage::compress_blocks(const BlockRange& range, const std::vector<BlockWriter*>& outputs,
+                                  const std::vector<EncodeLevel>& levels, const EncoderOptions& options,
+                                  EncodeStats* stats) const
 {
-	auto x_div = std::div(static_cast<int64_t>(m_header.size_x), BLOCK_SIZE);
-	auto y_div = std::div(static_cast<int64_t>(m_header.size_y), BLOCK_SIZE);
-	uint32_t x_blocks = x_div.quot + (x_div.rem == 0 ? 0 : 1);
-	uint32_t y_blocks = y_div.quot + (y_div.rem == 0 ? 0 : 1);
+	const bool use_dct = options.transform != TransformPolicy::HaarOnly;
+	const bool use_haar = options.transform != TransformPolicy::DctOnly;
 
-	free();
-	m_data = reinterpret_cast<uint8_t*>(malloc(m_header.size_x * m_header.size_y * 3));
+	for (uint32_t i = range.firstRow; i < range.endRow; i++) {
+		SQH_TRACE_SCOPE("compress band");
 
-	for (int i = 0; i < y_blocks; i++) {
-		for (int j = 0; j < x_blocks; j++) {
+		for (uint32_t j = range.firstColumn; j < range.endColumn; j++) {
 			for (int c = 0; c < 3; c++) {
-				uint8_t info_byte = 0;
-				input_file.read(reinterpret_cast<char*>(&info_byte), sizeof(info_byte));
+				auto block = load_block(i, j, c);
 
-				math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> f_bar;
+				// the transforms do not depend on the level, only the quantization does
+				math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> dct_coefficients;
+				math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> haar_coefficients;
+				if (use_dct)
+					dct_coefficients = forward_transform(block, DCT_TRANSFORM);
+				if (use_haar)
+					haar_coefficients = forward_transform(block, HAAR_TRANSFORM);
 
-				if (info_byte & static_cast<uint8_t>(InfoByte::IsDct))
-				{
-					// DCT
-					f_bar = inverse_transform_block(input_file, info_byte, T_dct, m_dctQTable);
-				}
-				else
+				for (size_t level = 0; level < levels.size(); level++)
 				{
-					// HAAR
-					f_bar = inverse_transform_block(input_file, info_byte, T_haar, m_haarQTable);
-				}
+					EncodeStats& level_stats = stats[level];
 
-				for (int k = 0; k < 8; k++) { // row
-					for (int l = 0; l < 8; l++) { // col
-						if ((8 * i + k >= m_header.size_y) || (8 * j + l >= m_header.size_x)) continue;
-						m_data[3 * ((m_header.size_x * ((BLOCK_SIZE * i) + k)) + (BLOCK_SIZE * j) + l) + c] = f_bar.data[k][l];
-					}
+					CompressedBlock best_block;
+					double quality = 0.0;
+					encode_block(block, dct_coefficients, haar_coefficients, levels[level], options, best_block, quality);
+
+					level_stats.averageQuality += quality;
+					if (best_block.infoByte & static_cast<uint8_t>(InfoByte::IsDct))
+						level_stats.dctBlocks++;
+					else
+						level_stats.haarBlocks++;
+
+					if (best_block.infoByte & static_cast<uint8_t>(InfoByte::IsLong))
+						level_stats.longBlocks++;
+					else
+						level_stats.shortBlocks++;
+					level_stats.channelBytes[c] += getCompressedSize(best_block);
+
+					outputs[level]->writeBlock(best_block);
 				}
 			}
 		}
 	}
+}
 
-	return true;
+void SquashImage::encode_block(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>& block,
+                               const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& dct_coefficients,
+                               const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& haar_coefficients,
+                               const EncodeLevel& tables, const EncoderOptions& options,
+                               CompressedBlock& best_block, double& best_quality)
+{
+	const bool use_dct = options.transform != TransformPolicy::HaarOnly;
+	const bool use_haar = options.transform != TransformPolicy::DctOnly;
+
+	CompressedBlock compressed_dct{};
+	CompressedBlock compressed_haar{};
+	double dct_quality = 0.0;
+	double haar_quality = 0.0;
+
+	if (use_dct)
+	{
+		auto block_dct = quantize(dct_coefficients, tables.dctReciprocal);
+		compress_block(block_dct, compressed_dct, false);
+		dct_quality = computeCompressionQuality(
+			block, test_inverse_transform_block(block_dct, DCT_TRANSFORM, tables.dctTable,
+			                                  coefficient_count(compressed_dct.infoByte)),
+			getCompressedSize(compressed_dct));
+	}
+	if (use_haar)
+	{
+		auto block_haar = quantize(haar_coefficients, tables.haarReciprocal);
+		compress_block(block_haar, compressed_haar, true);
+		haar_quality = computeCompressionQuality(
+			block, test_inverse_transform_block(block_haar, HAAR_TRANSFORM, tables.haarTable,
+			                                  coefficient_count(compressed_haar.infoByte)),
+			getCompressedSize(compressed_haar));
+	}
+
+	if (!use_dct || (use_haar && abs(options.quality - haar_quality) < abs(options.quality - dct_quality)))
+	{
+		best_block = compressed_haar;
+		best_quality = haar_quality;
+	}
+	else
+	{
+		best_block = compressed_dct;
+		best_quality = dct_quality;
+	}
 }
 
-bool SquashImage::compress(std::ofstream &output_file)
+uint64_t SquashImage::estimate_size(const std::vector<OptimizationSample>& blocks, const EncodeLevel& tables,
+                                    const EncoderOptions& options, unsigned int thread_count)
 {
-	//findOptimalQTables();
+	size_t chunk_count = std::min(blocks.size(), OPTIMIZATION_CHUNKS);
+	std::vector<uint64_t> chunk_sizes(chunk_count);
 
-	auto Q_haar_data = m_haarQTable.asType<uint8_t>().flatten(flatten_horiz);
-	auto Q_dct_data = m_dctQTable.asType<uint8_t>().flatten(flatten_horiz);
-	output_file.write(reinterpret_cast<const char*>(Q_dct_data.data()), BLOCK_SIZE * BLOCK_SIZE);
-	output_file.write(reinterpret_cast<const char*>(Q_haar_data.data()), BLOCK_SIZE * BLOCK_SIZE);
+	for_each_parallel(chunk_count, thread_count, [&](size_t chunk) {
+		for (size_t k = blocks.size() * chunk / chunk_count; k < blocks.size() * (chunk + 1) / chunk_count; k++)
+		{
+			CompressedBlock best_block;
+			double quality = 0.0;
+			encode_block(blocks[k].pixels, blocks[k].dct, blocks[k].haar, tables, options, best_block, quality);
+			chunk_sizes[chunk] += stored_size(best_block, options);
+		}
+	});
 
-	auto x_div = std::div(static_cast<int64_t>(m_header.size_x), BLOCK_SIZE);
-	auto y_div = std::div(static_cast<int64_t>(m_header.size_y), BLOCK_SIZE);
-	uint32_t x_blocks = x_div.quot + (x_div.rem == 0 ? 0 : 1);
-	uint32_t y_blocks = y_div.quot + (y_div.rem == 0 ? 0 : 1);
+	uint64_t size = 0;
+	for (uint64_t chunk_size : chunk_sizes)
+	{
+		size += chunk_size;
+	}
+	return size;
+}
 
-	// STATS
-	double averageCompressionQuality = 0.0;
+float SquashImage::fitting_scale(const std::vector<OptimizationSample>& blocks, const EncodeLevel& base)
+{
+	// largest magnitude of every coefficient over the blocks
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> dct_bound;
+	math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> haar_bound;
+	for (const auto& block : blocks)
+	{
+		for (size_t u = 0; u < BLOCK_SIZE; u++)
+		{
+			for (size_t v = 0; v < BLOCK_SIZE; v++)
+			{
+				dct_bound.data[u][v] = std::max(dct_bound.data[u][v], std::abs(block.dct.data[u][v]));
+				haar_bound.data[u][v] = std::max(haar_bound.data[u][v], std::abs(block.haar.data[u][v]));
+			}
+		}
+	}
 
-	for (int i = 0; i < y_blocks; i++) {
-		for (int j = 0; j < x_blocks; j++) {
-			for (int c = 0; c < 3; c++) {
-				auto block = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>::FromFunction(
-					[this, i, j, c](size_t k, size_t l) -> uint8_t {
-						if (8 * j + l >= m_header.size_x) return 128;
-						if (8 * i + k >= m_header.size_y) return 128;
+	// a bound quantizes to 127 at most with the scaled table (which is rounded, hence the margin of half a step)
+	float scale = MIN_RATE_SCALE;
+	for (size_t u = 0; u < BLOCK_SIZE; u++)
+	{
+		for (size_t v = 0; v < BLOCK_SIZE; v++)
+		{
+			scale = std::max({scale, (dct_bound.data[u][v] / 127.f + 0.5f) / base.dctTable.data[u][v],
+			                  (haar_bound.data[u][v] / 127.f + 0.5f) / base.haarTable.data[u][v]});
+		}
+	}
 
-						return m_data[3 * ((m_header.size_x * ((BLOCK_SIZE * i) + k)) + (BLOCK_SIZE * j) + l) + c];
-					});
+	return std::min(scale, MAX_RATE_SCALE);
+}
 
-				auto block_dct = transform_block(block, T_dct, m_dctQTable);
-				auto block_haar = transform_block(block, T_haar, m_haarQTable);
+uint64_t SquashImage::image_size(const EncodeLevel& tables, const EncoderOptions& options,
+                                 unsigned int thread_count) const
+{
+	build_planes();
 
-				CompressedBlock compressed_dct{};
-				CompressedBlock compressed_haar{};
-				CompressedBlock* best_block;
+	const bool use_dct = options.transform != TransformPolicy::HaarOnly;
+	const bool use_haar = options.transform != TransformPolicy::DctOnly;
 
-				compress_block(block_dct, compressed_dct, false);
-				auto dct_quality = computeCompressionQuality(
-					block, test_inverse_transform_block(block_dct, T_dct, m_dctQTable),
-					getCompressedSize(compressed_dct));
-				compress_block(block_haar, compressed_haar, true);
-				auto haar_quality = computeCompressionQuality(
-					block, test_inverse_transform_block(block_haar, T_haar, m_haarQTable),
-					getCompressedSize(compressed_haar));
+	uint32_t x_blocks = block_count(m_header.size_x);
+	uint32_t y_blocks = block_count(m_header.size_y);
 
-				if (abs(Quality - haar_quality) < abs(Quality - dct_quality))
-				{
-					best_block = &compressed_haar;
-					averageCompressionQuality += haar_quality;
-				}
-				else
-				{
-					best_block = &compressed_dct;
-					averageCompressionQuality += dct_quality;
-				}
+	// by bands of rows as compress() does
+	size_t band_count = std::min<size_t>(y_blocks, BANDS_PER_THREAD * thread_count);
+	std::vector<uint64_t> band_bytes(band_count);
 
-				output_file.write(reinterpret_cast<const char*>(
-									&best_block->infoByte), sizeof(best_block->infoByte));
-				if (best_block->infoByte & static_cast<uint8_t>(InfoByte::IsLong))
-				{
-					output_file.write(reinterpret_cast<const char *>(
-						                  &best_block->table), sizeof(best_block->table));
+	for_each_parallel(band_count, thread_count, [&](size_t band) {
+		for (auto i = static_cast<uint32_t>(y_blocks * band / band_count); i < y_blocks * (band + 1) / band_count; i++) {
+			for (uint32_t j = 0; j < x_blocks; j++) {
+				for (int c = 0; c < 3; c++) {
+					auto block = load_block(i, j, c);
+
+					math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> dct_coefficients;
+					math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> haar_coefficients;
+					if (use_dct)
+						dct_coefficients = forward_transform(block, DCT_TRANSFORM);
+					if (use_haar)
+						haar_coefficients = forward_transform(block, HAAR_TRANSFORM);
+
+					CompressedBlock best_block;
+					double quality = 0.0;
+					encode_block(block, dct_coefficients, haar_coefficients, tables, options, best_block, quality);
+					band_bytes[band] += stored_size(best_block, options);
 				}
-				output_file.write(reinterpret_cast<const char *>(
-					                  &best_block->data), sizeof(int8_t) * best_block->dataCount);
 			}
 		}
-	}
-
-	averageCompressionQuality /= static_cast<float>(y_blocks) * static_cast<float>(x_blocks) * 3.f;
-	std::cout << "Compression success: " << averageCompressionQuality << " compared to requested: " << Quality << std::endl;
+	});
 
-	return true;
+	uint64_t size = 0;
+	for (uint64_t bytes : band_bytes)
+	{
+		size += bytes;
+	}
+	return size;
 }
 
 size_t SquashImage::getCompressedSize(CompressedBlock& compressed_block)
@@ -569,6 +2632,14 @@ size_t SquashImage::getCompressedSize(CompressedBlock& compressed_block)
 	return totalSize;
 }
 
+size_t SquashImage::stored_size(CompressedBlock& compressed_block, const EncoderOptions& options)
+{
+	if (options.progressive)
+		return progressive_size(compressed_block);
+
+	return getCompressedSize(compressed_block);
+}
+
 double SquashImage::computeCompressionQuality(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> &original,
                                              const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t> &compressed,
                                              size_t compressed_size)
@@ -576,7 +2647,7 @@ double SquashImage::computeCompressionQuality(const math::Matrix<BLOCK_SIZE, BLO
 
 	// 1 is identical, 0 is "completely different"
 	//auto block_resemblance = original.asType<double>().dot(compressed.asType<double>()) / 100000 / 50; // (0.25 - 0.90)
-	auto block_resemblance = exp(-(original.asType<float>() - compressed.asType<float>()).norm() / 64.f);
+	auto block_resemblance = exp(-(original.cast<float>() - compressed.cast<float>()).eval().norm() / 64.f);
 
 	// 0 is impossible >= 1: means no / bad compression
 	auto compression_ratio = static_cast<double>(compressed_size) / static_cast<double>(DEFAULT_BLOCK_MEM_SIZE);
@@ -584,200 +2655,170 @@ double SquashImage::computeCompressionQuality(const math::Matrix<BLOCK_SIZE, BLO
 	return sqrt(block_resemblance * block_resemblance + compression_ratio * compression_ratio);
 }
 
-void SquashImage::findOptimalQTables()
+SquashImage::EncodeLevel SquashImage::make_level(const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& dct_table,
+                                                 const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& haar_table)
 {
+	return {dct_table, haar_table, reciprocal(dct_table), reciprocal(haar_table)};
+}
 
-	// TO COMPUTE DIVERGENCE: Quality - compressionQuality
-	// +ve: block is very nice and not very compressed
-	// -ve: block is ugly and too compressed
-	auto x_div = std::div(static_cast<int64_t>(m_header.size_x), BLOCK_SIZE);
-	auto y_div = std::div(static_cast<int64_t>(m_header.size_y), BLOCK_SIZE);
-	uint32_t x_blocks = x_div.quot + (x_div.rem == 0 ? 0 : 1);
-	uint32_t y_blocks = y_div.quot + (y_div.rem == 0 ? 0 : 1);
+SquashImage::EncodeLevel SquashImage::findOptimalQTables(const EncodeLevel& start, const EncoderOptions& options) const
+{
+	SQH_TRACE_SCOPE("findOptimalQTables");
 
-	for (size_t attempt = 0; attempt < OPTIMIZATION_ATTEMPTS; attempt++)
-	{
-		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> averageHaarTransform;
-		math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> averageDctTransform;
-		double averageDctQuality = 0.0;
-		double averageHaarQuality = 0.0;
+	unsigned int thread_count = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
 
-		for (int i = 0; i < y_blocks; i++) {
-			for (int j = 0; j < x_blocks; j++) {
-				for (int c = 0; c < 3; c++) {
+	std::vector<OptimizationSample> samples;
+	collect_samples(OPTIMIZATION_SAMPLES, thread_count, samples);
 
-					auto block = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>::FromFunction(
-						[this, i, j, c](size_t k, size_t l) -> uint8_t {
-							if (8 * j + l >= m_header.size_x) return 128;
-							if (8 * i + k >= m_header.size_y) return 128;
+	return tune_qtables(samples, start, options.quality, thread_count);
+}
 
-							return m_data[3 * ((m_header.size_x * ((BLOCK_SIZE * i) + k)) + (BLOCK_SIZE * j) + l) + c];
-						});
+bool SquashImage::trainQTables(const std::vector<std::string>& image_paths, const EncoderOptions& options,
+                               QTableProfile& profile)
+{
+	SQH_TRACE_SCOPE("trainQTables");
 
-					math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> transformed_block_haar;
-					auto block_haar = transform_block(block, T_haar, m_haarQTable, &transformed_block_haar);
-					math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> transformed_block_dct;
-					auto block_dct = transform_block(block, T_dct, m_dctQTable, &transformed_block_dct);
+	unsigned int thread_count = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
 
-					CompressedBlock compressed_haar{};
-					CompressedBlock compressed_dct{};
+	// the images share the sample budget, but each gives at least one block of every channel
+	size_t image_samples = std::clamp<size_t>(TRAINING_SAMPLES / std::max<size_t>(image_paths.size(), 1), 3,
+	                                          OPTIMIZATION_SAMPLES);
 
-					compress_block(block_haar, compressed_haar, true);
-					auto haar_quality = computeCompressionQuality(
-						block, test_inverse_transform_block(block_haar, T_haar, m_haarQTable),
-						getCompressedSize(compressed_haar));
-					compress_block(block_dct, compressed_dct, true);
-					auto dct_quality = computeCompressionQuality(
-						block, test_inverse_transform_block(block_dct, T_dct, m_dctQTable),
-						getCompressedSize(compressed_dct));
+	// images are loaded in parallel, one at a time per thread, and their samples are kept in the order of the paths
+	std::vector<std::vector<OptimizationSample>> image_sample_sets(image_paths.size());
+	for_each_parallel(image_paths.size(), thread_count, [&](size_t k) {
+		SquashImage image(image_paths[k]);
+		if (image.getData() != nullptr)
+			image.collect_samples(image_samples, 1, image_sample_sets[k]);
+	});
 
-					if (abs(Quality - haar_quality) <= abs(Quality - dct_quality))
-					{
-						// use haar
-						averageHaarTransform = averageHaarTransform + transformed_block_haar;
-						averageHaarQuality += haar_quality;
-					}
-					else
-					{
-						// use dct
-						averageDctTransform = averageDctTransform + transformed_block_dct;
-						averageDctQuality += dct_quality;
-					}
-				}
-			}
-		}
+	std::vector<OptimizationSample> samples;
+	uint32_t images = 0;
+	for (auto& image_sample_set : image_sample_sets)
+	{
+		if (image_sample_set.empty())
+			continue;
 
-		auto total_blocks = static_cast<float>(y_blocks * x_blocks * 3);
-		averageDctTransform = averageDctTransform / total_blocks;
-		averageHaarTransform = averageHaarTransform / total_blocks;
-		averageDctQuality /= total_blocks;
-		averageHaarQuality /= total_blocks;
-		std::cout << averageHaarQuality << std::endl;
+		samples.insert(samples.end(), image_sample_set.begin(), image_sample_set.end());
+		image_sample_set = {};
+		images++;
+	}
 
-		// process haar:
-		if ((Quality - averageHaarQuality) < 0.0)
-		{
-			std::cout << "HIGHER HAAR" << std::endl;
+	if (samples.empty())
+	{
+		std::cout << "[ERROR] (SquashImage): None of the training images could be opened" << std::endl;
+		return false;
+	}
 
-			//m_haarQTable = m_haarQTable * (1.f + LEARN_RATE);
+	auto result = tune_qtables(samples, make_level(Q_dct_default, Q_haar_default), options.quality, thread_count);
 
-			//m_haarQTable = (m_haarQTable + averageHaarTransform.asType2<float>([&attempt](float value)
-            //   {
-            //       if (abs(value) <= 0.000001f) return 50.f;
-            //       else return fmin(50.f, (LEARN_RATE / abs(value) / static_cast<float>(attempt)));
-            //   })).asType<float>([](float value){return fmax(1.f, value);});
-		}
-		else if ((Quality - averageHaarQuality) > 0.0)
-		{
+	profile.dctTable = result.dctTable;
+	profile.haarTable = result.haarTable;
+	profile.quality = options.quality;
+	profile.images = images;
+	return true;
+}
 
-			//m_haarQTable = m_haarQTable / (1.f + LEARN_RATE);
+void SquashImage::collect_samples(size_t max_samples, unsigned int thread_count,
+                                  std::vector<OptimizationSample>& samples) const
+{
+	build_planes();
 
-			//m_haarQTable = (m_haarQTable - averageHaarTransform.asType2<float>([&attempt](float value)
-	        //   {
-		    //       if (abs(value) <= 0.000001f) return 50.f;
-		    //       else return fmin(50.f, (LEARN_RATE / abs(value) / static_cast<float>(attempt)));
-	        //   })).asType<float>([](float value){return fmax(1.f, value);});
-		}
+	uint32_t x_blocks = block_count(m_header.size_x);
+	size_t positions = static_cast<size_t>(x_blocks) * block_count(m_header.size_y);
 
-		// process dct:
-		if ((Quality - averageDctQuality) < 0.0)
-		{
-			std::cout << "HIGHER DCT" << std::endl;
+	// one block position is drawn from each of sample_positions equal runs of the raster order, so that the sample
+	// covers the whole image. The draw is seeded by the run, so the tables do not change from one encode to the next
+	size_t sample_positions = std::min(positions, max_samples / 3);
+	size_t first = samples.size();
+	samples.resize(first + 3 * sample_positions);
 
-			//m_dctQTable = (m_dctQTable + averageDctTransform.asType2<float>([&attempt](float value)
-            //   {
-            //       if (abs(value) <= 0.000001f) return 50.f;
-            //       else return fmin(50.f, (LEARN_RATE / abs(value) / static_cast<float>(attempt)));
-            //   })).asType<float>([](float value){return fmax(1.f, value);});
+	size_t chunk_count = std::min(3 * sample_positions, OPTIMIZATION_CHUNKS);
+	auto chunk_begin = [&](size_t chunk) { return 3 * sample_positions * chunk / chunk_count; };
 
-			m_dctQTable = m_dctQTable * (1.f + LEARN_RATE);
-		}
-		else if ((Quality - averageDctQuality) > 0.0)
+	// the transforms do not depend on the tables, they are computed once for all attempts
+	for_each_parallel(chunk_count, thread_count, [&](size_t chunk) {
+		for (size_t k = chunk_begin(chunk); k < chunk_begin(chunk + 1); k++)
 		{
-			std::cout << "LOWER DCT" << std::endl;
-
-			m_dctQTable = m_dctQTable / (1.f + LEARN_RATE);
-
-			//m_dctQTable = (m_dctQTable - averageDctTransform.asType2<float>([&attempt](float value)
-            //   {
-            //       if (abs(value) <= 0.000001f) return 10.f;
-            //       else return fmin(10.f, (LEARN_RATE / abs(value) / static_cast<float>(attempt)));
-            //   })).asType<float>([](float value){return fmax(8.f, value);});
+			size_t run = k / 3;
+			size_t run_begin = positions * run / sample_positions;
+			size_t run_length = positions * (run + 1) / sample_positions - run_begin;
+			size_t position = run_begin + mix_bits(run) % run_length;
+
+			auto& sample = samples[first + k];
+			sample.pixels = load_block(static_cast<uint32_t>(position / x_blocks), static_cast<uint32_t>(position % x_blocks), k % 3);
+			sample.dct = forward_transform(sample.pixels, DCT_TRANSFORM);
+			sample.haar = forward_transform(sample.pixels, HAAR_TRANSFORM);
 		}
-	}
-
-	std::ofstream output_file("./output_matrices.txt", std::ios::out);
-	m_haarQTable.asType<int>().toStream(output_file);
-	m_dctQTable.asType<int>().toStream(output_file);
-	output_file.close();
+	});
 }
 
-/*
-void SquashImage::findOptimalDCTQTable()
+SquashImage::EncodeLevel SquashImage::tune_qtables(const std::vector<OptimizationSample>& samples,
+                                                   const EncodeLevel& start, double quality, unsigned int thread_count)
 {
-	auto x_div = std::div(static_cast<int64_t>(m_header.size_x), BLOCK_SIZE);
-	auto y_div = std::div(static_cast<int64_t>(m_header.size_y), BLOCK_SIZE);
-	uint32_t x_blocks = x_div.quot + (x_div.rem == 0 ? 0 : 1);
-	uint32_t y_blocks = y_div.quot + (y_div.rem == 0 ? 0 : 1);
-
-	size_t attempts = 0;
-	while(attempts < OPTIMIZATION_ATTEMPTS)
-	{
-		// STATS
-		double averageCompressionQuality = 0.0;
-
-		for (int i = 0; i < y_blocks; i++) {
-			if (attempts >= OPTIMIZATION_ATTEMPTS)
-				break;
+	// TO COMPUTE DIVERGENCE: Quality - compressionQuality
+	// +ve: block is very nice and not very compressed
+	// -ve: block is ugly and too compressed
+	size_t chunk_count = std::min(samples.size(), OPTIMIZATION_CHUNKS);
+	auto chunk_begin = [&](size_t chunk) { return samples.size() * chunk / chunk_count; };
 
-			for (int j = 0; j < x_blocks; j++) {
-				if (attempts >= OPTIMIZATION_ATTEMPTS)
-					break;
+	// only the DCT table is tuned, the Haar table stays the one of start
+	EncodeLevel result = start;
+	// sum of the compression quality of the samples that chose the DCT, per chunk
+	std::vector<double> chunk_dct_quality(chunk_count);
 
-				for (int c = 0; c < 3; c++) {
-					if (attempts >= OPTIMIZATION_ATTEMPTS)
-						break;
+	for (size_t attempt = 0; attempt < OPTIMIZATION_ATTEMPTS; attempt++)
+	{
+		for_each_parallel(chunk_count, thread_count, [&](size_t chunk) {
+			double& dct_quality_sum = chunk_dct_quality[chunk];
+			dct_quality_sum = 0.0;
 
-					attempts ++;
+			for (size_t k = chunk_begin(chunk); k < chunk_begin(chunk + 1); k++)
+			{
+				const auto& sample = samples[k];
 
-					auto block = math::Matrix<BLOCK_SIZE, BLOCK_SIZE, uint8_t>::FromFunction(
-						[this, i, j, c](size_t k, size_t l) -> uint8_t {
-							if (8 * j + l >= m_header.size_x) return 128;
-							if (8 * i + k >= m_header.size_y) return 128;
+				auto block_haar = quantize(sample.haar, result.haarReciprocal);
+				auto block_dct = quantize(sample.dct, result.dctReciprocal);
 
-							return m_data[3 * ((m_header.size_x * ((BLOCK_SIZE * i) + k)) + (BLOCK_SIZE * j) + l) + c];
-						});
+				CompressedBlock compressed_haar{};
+				CompressedBlock compressed_dct{};
 
-					math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float> transformed_block;
-					auto block_dct = transform_block(block, T_dct, m_dctQTable, &transformed_block);
+				compress_block(block_haar, compressed_haar, true);
+				auto haar_quality = computeCompressionQuality(
+					sample.pixels, test_inverse_transform_block(block_haar, HAAR_TRANSFORM, result.haarTable,
+					                                          coefficient_count(compressed_haar.infoByte)),
+					getCompressedSize(compressed_haar));
+				compress_block(block_dct, compressed_dct, false);
+				auto dct_quality = computeCompressionQuality(
+					sample.pixels, test_inverse_transform_block(block_dct, DCT_TRANSFORM, result.dctTable,
+					                                          coefficient_count(compressed_dct.infoByte)),
+					getCompressedSize(compressed_dct));
 
-					CompressedBlock compressed_dct{};
+				// blocks closer to the quality with the Haar transform would be encoded with it
+				if (abs(quality - haar_quality) > abs(quality - dct_quality))
+					dct_quality_sum += dct_quality;
+			}
+		});
 
-					compress_block(block_dct, compressed_dct, true);
-					auto dct_quality = computeCompressionQuality(
-						block, test_inverse_transform_block(block_dct, T_dct, m_dctQTable),
-						getCompressedSize(compressed_dct));
+		// the partial sums are added in the same order whatever the number of threads
+		double averageDctQuality = 0.0;
+		for (double dct_quality_sum : chunk_dct_quality)
+		{
+			averageDctQuality += dct_quality_sum;
+		}
+		averageDctQuality /= static_cast<double>(samples.size());
 
-					if ((Quality - dct_quality) < 0.0)
-					{
-						m_dctQTable = (m_dctQTable + transformed_block.asType<float>([](float value)
-						                                                               {
-							                                                               if (abs(value) <= 0.00001f) return 1.f;
-							                                                               else return fmin(1.f, LEARN_RATE / abs(value));
-						                                                               })).asType<float>([](float value){return fmax(1.f, value);});
-					}
-					else if ((Quality - dct_quality) > 0.0)
-					{
-						m_dctQTable = (m_dctQTable - transformed_block.asType<float>([](float value)
-						                                                               {
-							                                                               if (abs(value) <= 0.00001f) return 1.f;
-							                                                               else return fmin(1.f, LEARN_RATE / abs(value));
-						                                                               })).asType<float>([](float value){return fmax(1.f, value);});
-					}
-				}
-			}
+		if ((quality - averageDctQuality) < 0.0)
+		{
+			result = make_level(scaleQTable(result.dctTable, 1.f + LEARN_RATE), result.haarTable);
+		}
+		else if ((quality - averageDctQuality) > 0.0)
+		{
+			result = make_level(scaleQTable(result.dctTable, 1.f / (1.f + LEARN_RATE)), result.haarTable);
 		}
 	}
-}*/
+
+	return result;
+}
 
 } // namespace sqh
@@ -0,0 +1,153 @@
+/**
+ * @file PerfCounters.cpp
+ * @author Eliot Fondere
+ * @brief Implementation of PerfCounters.hpp
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include <squashlib/trace/PerfCounters.hpp>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+namespace sqh::trace
+{
+
+#if defined(__linux__)
+
+namespace
+{
+
+// in the order of the CounterValues members
+constexpr uint64_t COUNTER_CONFIGS[] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// a group is read at once as its number of counters, the times it was enabled and running, then one value per counter
+constexpr uint64_t READ_FORMAT = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+// group_leader is -1 for the first counter of the group, which is the one enabled and disabled
+int open_counter(uint64_t config, int group_leader)
+{
+	perf_event_attr attributes;
+	std::memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.config = config;
+	attributes.disabled = group_leader < 0 ? 1 : 0;
+	attributes.inherit = 1;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	attributes.read_format = READ_FORMAT;
+
+	// this thread and the ones it creates afterwards, on any CPU
+	return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, group_leader, 0));
+}
+
+// scales a count to the whole measurement when the kernel had to multiplex the group
+uint64_t scaled_count(uint64_t value, uint64_t time_enabled, uint64_t time_running)
+{
+	if (time_running == 0)
+		return 0;
+
+	if (time_running < time_enabled)
+		return static_cast<uint64_t>(static_cast<double>(value) * static_cast<double>(time_enabled) / static_cast<double>(time_running));
+
+	return value;
+}
+
+} // namespace
+
+PerfCounters::PerfCounters()
+{
+	// the first counter that opens leads the group, the ones the CPU does not have are left out of it
+	for (size_t k = 0; k < COUNTER_COUNT; k++)
+	{
+		m_fileDescriptors[k] = open_counter(COUNTER_CONFIGS[k], m_groupLeader);
+		if (m_groupLeader < 0)
+			m_groupLeader = m_fileDescriptors[k];
+	}
+}
+
+PerfCounters::~PerfCounters()
+{
+	for (int file_descriptor : m_fileDescriptors)
+	{
+		if (file_descriptor >= 0)
+			close(file_descriptor);
+	}
+}
+
+bool PerfCounters::available() const
+{
+	return m_groupLeader >= 0;
+}
+
+void PerfCounters::start()
+{
+	if (m_groupLeader < 0)
+		return;
+
+	ioctl(m_groupLeader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(m_groupLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+CounterValues PerfCounters::stop()
+{
+	CounterValues values;
+	if (m_groupLeader < 0)
+		return values;
+
+	ioctl(m_groupLeader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	// number of counters, time enabled, time running, then the values in the order the counters joined the group
+	uint64_t data[3 + COUNTER_COUNT] = {};
+	ssize_t bytes = read(m_groupLeader, data, sizeof(data));
+	if (bytes < static_cast<ssize_t>(3 * sizeof(uint64_t)) || data[0] > COUNTER_COUNT)
+		return values;
+
+	uint64_t* counts[COUNTER_COUNT] = {&values.cycles, &values.instructions, &values.cacheMisses, &values.branchMisses};
+	for (size_t k = 0, member = 0; k < COUNTER_COUNT && member < data[0]; k++)
+	{
+		if (m_fileDescriptors[k] >= 0)
+			*counts[k] = scaled_count(data[3 + member++], data[1], data[2]);
+	}
+
+	return values;
+}
+
+#else
+
+PerfCounters::PerfCounters()
+{
+	m_fileDescriptors.fill(-1);
+}
+
+PerfCounters::~PerfCounters() = default;
+
+bool PerfCounters::available() const
+{
+	return false;
+}
+
+void PerfCounters::start()
+{
+}
+
+CounterValues PerfCounters::stop()
+{
+	return {};
+}
+
+#endif
+
+} // namespace sqh::trace
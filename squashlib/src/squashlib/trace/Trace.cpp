@@ -0,0 +1,161 @@
+/**
+ * @file Trace.cpp
+ * @author Eliot Fondere
+ * @brief Implementation of Trace.hpp
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include <squashlib/trace/Trace.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sqh::trace
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Event
+{
+	const char* name;
+	uint64_t start;
+	uint64_t end;
+};
+
+// only written by its thread, count is published after the event so that an export sees complete events
+struct ThreadBuffer
+{
+	uint32_t threadId = 0;
+	std::unique_ptr<Event[]> events = std::make_unique<Event[]>(RING_CAPACITY);
+	std::atomic<uint64_t> count = 0;
+};
+
+struct Registry
+{
+	std::mutex mutex;
+	// shared, so that the events of a thread are still exported after it exits
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+};
+
+Registry& registry()
+{
+	static Registry instance;
+	return instance;
+}
+
+Clock::time_point epoch()
+{
+	static const Clock::time_point start = Clock::now();
+	return start;
+}
+
+ThreadBuffer& thread_buffer()
+{
+	thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+		auto& instance = registry();
+		std::lock_guard<std::mutex> lock(instance.mutex);
+
+		auto created = std::make_shared<ThreadBuffer>();
+		created->threadId = static_cast<uint32_t>(instance.buffers.size() + 1);
+		instance.buffers.push_back(created);
+		return created;
+	}();
+
+	return *buffer;
+}
+
+} // namespace
+
+uint64_t now()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch()).count());
+}
+
+void record(const char* name, uint64_t start, uint64_t end)
+{
+	auto& buffer = thread_buffer();
+
+	uint64_t count = buffer.count.load(std::memory_order_relaxed);
+	buffer.events[count % RING_CAPACITY] = {name, start, end};
+	buffer.count.store(count + 1, std::memory_order_release);
+}
+
+void writeChromeTrace(std::ostream& output)
+{
+	auto& instance = registry();
+	std::lock_guard<std::mutex> lock(instance.mutex);
+
+	// fixed notation with nanosecond digits: the default one switches to exponents past a second and loses the precision
+	// the viewer needs to nest the spans. The caller's formatting is restored after
+	auto flags = output.flags();
+	auto precision = output.precision();
+	output << std::fixed << std::setprecision(3);
+
+	output << "{\"traceEvents\":[\n";
+
+	bool first = true;
+	auto separator = [&first]() { const char* result = first ? "" : ",\n"; first = false; return result; };
+
+	for (const auto& buffer : instance.buffers)
+	{
+		output << separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+		       << ",\"args\":{\"name\":\"thread " << buffer->threadId << "\"}}";
+
+		uint64_t count = buffer->count.load(std::memory_order_acquire);
+		uint64_t oldest = count > RING_CAPACITY ? count - RING_CAPACITY : 0;
+
+		for (uint64_t k = oldest; k < count; k++)
+		{
+			const Event& event = buffer->events[k % RING_CAPACITY];
+
+			// timestamps are in microseconds
+			output << separator() << "{\"name\":\"" << event.name << "\",\"cat\":\"squash\",\"ph\":\"X\""
+			       << ",\"ts\":" << static_cast<double>(event.start) / 1000.0
+			       << ",\"dur\":" << static_cast<double>(event.end - event.start) / 1000.0
+			       << ",\"pid\":1,\"tid\":" << buffer->threadId << "}";
+		}
+	}
+
+	output << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+
+	output.flags(flags);
+	output.precision(precision);
+}
+
+bool saveChromeTrace(std::string_view file_path)
+{
+	std::ofstream output_file(std::string(file_path), std::ios::out);
+	if (!output_file)
+	{
+		std::cout << "[ERROR] (Trace): Could not open file for writing: " << file_path << std::endl;
+		return false;
+	}
+
+	writeChromeTrace(output_file);
+	output_file.close();
+	return true;
+}
+
+void clear()
+{
+	auto& instance = registry();
+	std::lock_guard<std::mutex> lock(instance.mutex);
+
+	for (const auto& buffer : instance.buffers)
+	{
+		buffer->count.store(0, std::memory_order_relaxed);
+	}
+}
+
+} // namespace sqh::trace
@@ -0,0 +1,232 @@
+/**
+ * @file JpegBaseline.cpp
+ * @author Eliot Fondere
+ * @brief Implementation of JpegBaseline.hpp
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "JpegBaseline.hpp"
+
+#include <squashlib/squash.hpp>
+#include <squashlib/util/Parallel.hpp>
+#include <stb/stb_image.h>
+#include <stb/stb_image_write.h>
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace sqh::test
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// multiplies the default quantization tables, larger is smaller and worse
+constexpr float SQUASH_SCALES[] = {4.f, 2.f, 1.f, 0.5f, 0.25f};
+// stbi_write_jpg quality, from 1 to 100 (stb subsamples the chroma up to 90, not above)
+constexpr int JPEG_QUALITIES[] = {10, 30, 50, 70, 90, 95};
+
+constexpr size_t SQUASH_SETTINGS = std::size(SQUASH_SCALES);
+constexpr size_t SETTINGS = SQUASH_SETTINGS + std::size(JPEG_QUALITIES);
+
+struct RatePoint
+{
+	bool success = false;
+
+	uint64_t bytes = 0;
+	uint64_t samples = 0; // width * height * 3
+	double squared_error = 0.0;
+
+	double encode_ms = 0.0;
+	double decode_ms = 0.0;
+};
+
+const char* codec_name(size_t setting)
+{
+	return setting < SQUASH_SETTINGS ? "squash" : "jpeg";
+}
+
+double setting_value(size_t setting)
+{
+	return setting < SQUASH_SETTINGS ? SQUASH_SCALES[setting] : JPEG_QUALITIES[setting - SQUASH_SETTINGS];
+}
+
+double elapsed_ms(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+double squared_error(const uint8_t* original, const uint8_t* decoded, uint64_t samples)
+{
+	double error = 0.0;
+	for (uint64_t k = 0; k < samples; k++)
+	{
+		double dif = static_cast<double>(original[k]) - static_cast<double>(decoded[k]);
+		error += dif * dif;
+	}
+	return error;
+}
+
+double psnr(double mse)
+{
+	return mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+RatePoint squash_point(SquashImage& image, const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& dct_table,
+                       const math::Matrix<BLOCK_SIZE, BLOCK_SIZE, float>& haar_table, float scale)
+{
+	RatePoint point;
+	const auto& header = image.getHeader();
+	point.samples = static_cast<uint64_t>(header.size_x) * header.size_y * 3;
+
+	image.setQTables(SquashImage::scaleQTable(dct_table, scale), SquashImage::scaleQTable(haar_table, scale));
+
+	std::vector<uint8_t> encoded;
+	auto start = Clock::now();
+	bool encoded_ok = image.encode(encoded);
+	point.encode_ms = elapsed_ms(start);
+
+	SquashImage decoded;
+	start = Clock::now();
+	bool decoded_ok = encoded_ok && decoded.decode(encoded);
+	point.decode_ms = elapsed_ms(start);
+
+	if (!decoded_ok)
+		return point;
+
+	point.bytes = encoded.size();
+	point.squared_error = squared_error(image.getData(), decoded.getData(), point.samples);
+	point.success = true;
+
+	return point;
+}
+
+void append_bytes(void* context, void* data, int size)
+{
+	auto output = static_cast<std::vector<uint8_t>*>(context);
+	auto bytes = static_cast<const uint8_t*>(data);
+	output->insert(output->end(), bytes, bytes + size);
+}
+
+RatePoint jpeg_point(SquashImage& image, int quality)
+{
+	RatePoint point;
+	const auto& header = image.getHeader();
+	const auto width = static_cast<int>(header.size_x);
+	const auto height = static_cast<int>(header.size_y);
+	point.samples = static_cast<uint64_t>(header.size_x) * header.size_y * 3;
+
+	std::vector<uint8_t> encoded;
+	auto start = Clock::now();
+	bool encoded_ok = stbi_write_jpg_to_func(append_bytes, &encoded, width, height, 3, image.getData(), quality) != 0;
+	point.encode_ms = elapsed_ms(start);
+
+	if (!encoded_ok)
+		return point;
+
+	int decoded_width, decoded_height, channel_count;
+	start = Clock::now();
+	uint8_t* decoded = stbi_load_from_memory(encoded.data(), static_cast<int>(encoded.size()),
+	                                         &decoded_width, &decoded_height, &channel_count, 3);
+	point.decode_ms = elapsed_ms(start);
+
+	if (decoded == nullptr)
+		return point;
+
+	point.bytes = encoded.size();
+	point.squared_error = squared_error(image.getData(), decoded, point.samples);
+	point.success = true;
+
+	stbi_image_free(decoded);
+	return point;
+}
+
+} // namespace
+
+void run_jpeg_baseline(const fs::path& root_path, const std::vector<fs::path>& files, unsigned int thread_count)
+{
+	// points[SETTINGS * file + setting]
+	std::vector<RatePoint> points(files.size() * SETTINGS);
+
+	for_each_parallel(files.size(), thread_count, [&](size_t k) {
+		SquashImage image(files[k].string());
+		if (image.getData() == nullptr)
+			return;
+
+		const auto dct_table = image.getDCTQTable();
+		const auto haar_table = image.getHaarQTable();
+
+		for (size_t s = 0; s < SQUASH_SETTINGS; s++)
+		{
+			points[SETTINGS * k + s] = squash_point(image, dct_table, haar_table, SQUASH_SCALES[s]);
+		}
+		for (size_t s = SQUASH_SETTINGS; s < SETTINGS; s++)
+		{
+			points[SETTINGS * k + s] = jpeg_point(image, JPEG_QUALITIES[s - SQUASH_SETTINGS]);
+		}
+	});
+
+	std::ofstream csv_file(root_path / "rate_distortion.csv", std::ios::out);
+	csv_file << "file,codec,setting,bytes,bits_per_pixel,mse,psnr,encode_ms,decode_ms\n";
+
+	for (size_t k = 0; k < files.size(); k++)
+	{
+		for (size_t s = 0; s < SETTINGS; s++)
+		{
+			const auto& point = points[SETTINGS * k + s];
+			if (!point.success)
+				continue;
+
+			double mse = point.squared_error / static_cast<double>(point.samples);
+			csv_file << files[k].filename().string() << "," << codec_name(s) << "," << setting_value(s) << ","
+			         << point.bytes << "," << 8.0 * static_cast<double>(point.bytes) / static_cast<double>(point.samples / 3)
+			         << "," << mse << "," << psnr(mse) << "," << point.encode_ms << "," << point.decode_ms << "\n";
+		}
+	}
+
+	csv_file.close();
+
+	// corpus totals per setting: bits per pixel and PSNR over all samples, single-thread throughput in MB/s
+	std::cout << std::left << std::setw(8) << "codec" << std::right << std::setw(9) << "setting" << std::setw(9) << "bpp"
+	          << std::setw(11) << "PSNR (dB)" << std::setw(12) << "enc MB/s" << std::setw(12) << "dec MB/s" << std::endl;
+
+	for (size_t s = 0; s < SETTINGS; s++)
+	{
+		RatePoint total;
+		for (size_t k = 0; k < files.size(); k++)
+		{
+			const auto& point = points[SETTINGS * k + s];
+			if (!point.success)
+				continue;
+
+			total.bytes += point.bytes;
+			total.samples += point.samples;
+			total.squared_error += point.squared_error;
+			total.encode_ms += point.encode_ms;
+			total.decode_ms += point.decode_ms;
+		}
+
+		if (total.samples == 0)
+			continue;
+
+		double megabytes = static_cast<double>(total.samples) / 1e6;
+		std::cout << std::left << std::setw(8) << codec_name(s) << std::right << std::fixed
+		          << std::setw(9) << std::setprecision(2) << setting_value(s)
+		          << std::setw(9) << std::setprecision(3) << 8.0 * static_cast<double>(total.bytes) / static_cast<double>(total.samples / 3)
+		          << std::setw(11) << std::setprecision(2) << psnr(total.squared_error / static_cast<double>(total.samples))
+		          << std::setw(12) << std::setprecision(1) << megabytes / (total.encode_ms / 1000.0)
+		          << std::setw(12) << std::setprecision(1) << megabytes / (total.decode_ms / 1000.0) << std::endl;
+		std::cout << std::defaultfloat;
+	}
+}
+
+} // namespace sqh::test
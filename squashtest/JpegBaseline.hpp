@@ -0,0 +1,25 @@
+/**
+ * @file JpegBaseline.hpp
+ * @author Eliot Fondere
+ * @brief Rate-distortion and speed comparison of squash against stb's JPEG writer
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_JPEG_BASELINE_HPP
+#define INCLUDE_SQH_JPEG_BASELINE_HPP
+
+#include <filesystem>
+#include <vector>
+
+namespace sqh::test
+{
+
+// encodes and decodes every file with squash (sweeping a scale of its quantization tables) and with stbi_write_jpg
+// (sweeping its quality), writes every point to rate_distortion.csv in root_path and prints a summary per setting
+void run_jpeg_baseline(const std::filesystem::path& root_path, const std::vector<std::filesystem::path>& files,
+                       unsigned int thread_count);
+
+} // namespace sqh::test
+
+#endif // INCLUDE_SQH_JPEG_BASELINE_HPP
@@ -1,80 +1,538 @@
+/**
+ * @file main.cpp
+ * @author Eliot Fondere
+ * @brief Compresses a whole data set in parallel and collects size, error and timing statistics
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "argparse/argparse.hpp"
+#include "JpegBaseline.hpp"
 #include <squashlib/squash.hpp>
+#include <squashlib/trace/PerfCounters.hpp>
+#include <squashlib/trace/Trace.hpp>
+#include <squashlib/util/Parallel.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
 #include <vector>
 
 namespace fs = std::filesystem;
 
-int main()
+namespace
 {
-	// change this to use a different data set    \/
-	auto root_path = fs::path("./data/TEXT_DATASET/");
-	auto data_path = root_path / "data";
-	auto sqh_out_path = root_path / "out";
 
-	std::vector<uint64_t> compressed_sizes;
-	std::vector<uint64_t> uncompressed_sizes;
-	std::vector<float> file_average_error;
+using Clock = std::chrono::steady_clock;
 
-	sqh::SquashImage::Quality = 0.75f;
+struct FileResult
+{
+	fs::path path;
+	bool success = false;
 
-	for (const auto& entry : fs::directory_iterator(data_path))
+	uint64_t compressed_size = 0;
+	uint64_t uncompressed_size = 0;
+	float average_error = 0.f;
+	sqh::EncodeStats encode_stats;
+
+	// only filled when estimates are asked for
+	sqh::SizeEstimate estimate;
+	double estimate_ms = 0.0;
+
+	// time spent in each stage, in milliseconds
+	double load_ms = 0.0;
+	double encode_ms = 0.0;
+	double write_ms = 0.0;
+	double read_ms = 0.0;
+	double decode_ms = 0.0;
+
+	// hardware counters of each stage, when they are collected
+	sqh::trace::CounterValues load_counters;
+	sqh::trace::CounterValues encode_counters;
+	sqh::trace::CounterValues write_counters;
+	sqh::trace::CounterValues read_counters;
+	sqh::trace::CounterValues decode_counters;
+	uint64_t blocks = 0;
+};
+
+struct Stage
+{
+	const char* name;
+	double FileResult::* time;
+	sqh::trace::CounterValues FileResult::* counters;
+};
+
+constexpr Stage STAGES[] = {
+	{"load", &FileResult::load_ms, &FileResult::load_counters},
+	{"encode", &FileResult::encode_ms, &FileResult::encode_counters},
+	{"write", &FileResult::write_ms, &FileResult::write_counters},
+	{"read", &FileResult::read_ms, &FileResult::read_counters},
+	{"decode", &FileResult::decode_ms, &FileResult::decode_counters},
+};
+
+double elapsed_ms(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// measures the time, and the hardware counters if there are any, from its construction to stop()
+class StageMeasure
+{
+public:
+	explicit StageMeasure(sqh::trace::PerfCounters* counters)
+		: m_counters(counters)
+	{
+		if (m_counters != nullptr)
+			m_counters->start();
+		m_start = Clock::now();
+	}
+
+	void stop(double& time, sqh::trace::CounterValues& values)
+	{
+		time = elapsed_ms(m_start);
+		if (m_counters != nullptr)
+			values = m_counters->stop();
+	}
+
+private:
+	sqh::trace::PerfCounters* m_counters;
+	Clock::time_point m_start;
+};
+
+// profile and counters may be null, estimate_fraction is 0 when sizes are not estimated
+FileResult process_file(const fs::path& file_path, const fs::path& sqh_out_path, const sqh::EncoderOptions& settings,
+                        const sqh::QTableProfile* profile, double estimate_fraction, sqh::trace::PerfCounters* counters)
+{
+	SQH_TRACE_SCOPE("process file");
+
+	FileResult result;
+	result.path = file_path;
+
+	StageMeasure load(counters);
+	sqh::SquashImage base_image(file_path.string());
+	load.stop(result.load_ms, result.load_counters);
+
+	if (base_image.getData() == nullptr)
+		return result;
+
+	if (profile != nullptr)
+		base_image.setQTables(profile->dctTable, profile->haarTable);
+
+	sqh::EncoderOptions options = settings;
+	options.stats = &result.encode_stats;
+
+	std::vector<uint8_t> encoded;
+	StageMeasure encode(counters);
+	bool encoded_ok = base_image.encode(encoded, options);
+	encode.stop(result.encode_ms, result.encode_counters);
+
+	if (!encoded_ok)
+		return result;
+
+	if (estimate_fraction > 0.0)
+	{
+		auto start = Clock::now();
+		result.estimate = base_image.estimateSize(settings, estimate_fraction);
+		result.estimate_ms = elapsed_ms(start);
+	}
+
+	auto sqh_file_path = sqh_out_path / (file_path.filename().string() + ".sqh");
+	StageMeasure write(counters);
 	{
-		auto sqh_file_path = sqh_out_path / (entry.path().filename().string() + ".sqh");
+		SQH_TRACE_SCOPE("write file");
+		std::ofstream output_file(sqh_file_path, std::ios::binary);
+		output_file.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+	}
+	write.stop(result.write_ms, result.write_counters);
+
+	StageMeasure read(counters);
+	std::vector<uint8_t> file_data(fs::file_size(sqh_file_path));
+	{
+		SQH_TRACE_SCOPE("read file");
+		std::ifstream input_file(sqh_file_path, std::ios::binary);
+		input_file.read(reinterpret_cast<char*>(file_data.data()), static_cast<std::streamsize>(file_data.size()));
+	}
+	read.stop(result.read_ms, result.read_counters);
 
-		sqh::SquashImage base_image(entry.path().string());
-		base_image.save(sqh_file_path.string(), true);
+	sqh::SquashImage compressed_image;
+	StageMeasure decode(counters);
+	bool decoded_ok = compressed_image.decode(file_data);
+	decode.stop(result.decode_ms, result.decode_counters);
 
-		// extra info about file size, etc. is insignificant
-		uncompressed_sizes.push_back(base_image.getHeader().size_x * base_image.getHeader().size_y * 3);
-		compressed_sizes.push_back(fs::file_size(sqh_file_path));
+	if (!decoded_ok)
+		return result;
 
-		sqh::SquashImage compressed_image(sqh_file_path.string());
+	const auto& header = base_image.getHeader();
+	result.blocks = 3 * static_cast<uint64_t>((header.size_x + sqh::BLOCK_SIZE - 1) / sqh::BLOCK_SIZE)
+	                  * ((header.size_y + sqh::BLOCK_SIZE - 1) / sqh::BLOCK_SIZE);
 
-		double current_error = 0;
+	// extra info about file size, etc. is insignificant
+	result.uncompressed_size = static_cast<uint64_t>(header.size_x) * header.size_y * 3;
+	result.compressed_size = file_data.size();
 
-		for (size_t i = 0; i < base_image.getHeader().size_y; i++)
+	double current_error = 0;
+
+	for (size_t i = 0; i < header.size_y; i++)
+	{
+		for (size_t j = 0; j < header.size_x; j++)
 		{
-			for (size_t j = 0; j < base_image.getHeader().size_x; j++)
+			for (size_t c = 0; c < 3; c++)
 			{
-				for (size_t c = 0; c < 3; c++)
-				{
-					auto index = 3 * (base_image.getHeader().size_x * i + j) + c;
-					auto dif = static_cast<float>(base_image.getData()[index]) - static_cast<float>(compressed_image.getData()[index]);
+				auto index = 3 * (header.size_x * i + j) + c;
+				auto dif = static_cast<float>(base_image.getData()[index]) - static_cast<float>(compressed_image.getData()[index]);
 
-					current_error += dif * dif;
-				}
+				current_error += dif * dif;
 			}
 		}
+	}
 
-		current_error /= base_image.getHeader().size_y * base_image.getHeader().size_x;
-		std::cout << current_error << std::endl;
+	current_error /= static_cast<double>(header.size_y) * header.size_x;
+	result.average_error = static_cast<float>(current_error);
+	result.success = true;
 
-		file_average_error.push_back(static_cast<float>(current_error));
+	return result;
+}
+
+// nearest-rank percentile of sorted values
+double percentile(const std::vector<double>& sorted_values, double p)
+{
+	if (sorted_values.empty())
+		return 0.0;
+
+	auto rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sorted_values.size())));
+	return sorted_values[std::clamp<size_t>(rank, 1, sorted_values.size()) - 1];
+}
+
+std::string json_string(const std::string& value)
+{
+	std::string escaped = "\"";
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		escaped += c;
 	}
+	return escaped + "\"";
+}
 
+void write_stats(const fs::path& root_path, const std::vector<FileResult>& results)
+{
 	std::ofstream stats_file(root_path / "stats.txt", std::ios::out);
 
-	for (auto cs : compressed_sizes)
+	for (const auto& result : results)
 	{
-		stats_file << cs << " ";
+		stats_file << result.compressed_size << " ";
 	}
 	stats_file << "\n";
 
-	for (auto us : uncompressed_sizes)
+	for (const auto& result : results)
 	{
-		stats_file << us << " ";
+		stats_file << result.uncompressed_size << " ";
 	}
 	stats_file << "\n";
 
-	for (auto er : file_average_error)
+	for (const auto& result : results)
 	{
-		stats_file << er << " ";
+		stats_file << result.average_error << " ";
 	}
 	stats_file << std::endl;
 
 	stats_file.close();
+}
+
+// how close the size estimates were to the actual sizes
+void print_estimates(const std::vector<FileResult>& results, double estimate_fraction)
+{
+	size_t estimated = 0;
+	size_t within_bound = 0;
+	double relative_error = 0.0;
+	double estimate_ms = 0.0;
+	double encode_ms = 0.0;
+
+	for (const auto& result : results)
+	{
+		if (!result.success || result.estimate.sampledBlocks == 0)
+			continue;
+
+		auto error = std::abs(static_cast<double>(result.estimate.bytes) - static_cast<double>(result.compressed_size));
+		estimated++;
+		within_bound += error <= static_cast<double>(result.estimate.errorBound) ? 1 : 0;
+		relative_error += error / static_cast<double>(result.compressed_size);
+		estimate_ms += result.estimate_ms;
+		encode_ms += result.encode_ms;
+	}
+
+	if (estimated == 0)
+		return;
+
+	std::cout << "Size estimates from " << estimate_fraction * 100.0 << "% of the blocks: " << within_bound << " of "
+	          << estimated << " within their bound, mean error " << relative_error / static_cast<double>(estimated) * 100.0
+	          << "%, " << estimate_ms << " ms in total (encoding took " << encode_ms << " ms)" << std::endl;
+}
+
+void write_json(const fs::path& root_path, const std::vector<FileResult>& results, unsigned int thread_count,
+                double quality, double wall_time_ms, bool with_counters)
+{
+	uint64_t compressed_bytes = 0;
+	uint64_t uncompressed_bytes = 0;
+	for (const auto& result : results)
+	{
+		compressed_bytes += result.compressed_size;
+		uncompressed_bytes += result.uncompressed_size;
+	}
+
+	const double wall_time_s = wall_time_ms / 1000.0;
+	const double uncompressed_mb = static_cast<double>(uncompressed_bytes) / 1e6;
+
+	std::ofstream json_file(root_path / "stats.json", std::ios::out);
+
+	json_file << "{\n";
+	json_file << "  \"threads\": " << thread_count << ",\n";
+	json_file << "  \"quality\": " << quality << ",\n";
+	json_file << "  \"images\": " << results.size() << ",\n";
+	json_file << "  \"failed\": " << std::count_if(results.begin(), results.end(), [](const FileResult& result) {
+		return !result.success;
+	}) << ",\n";
+	json_file << "  \"wall_time_s\": " << wall_time_s << ",\n";
+	json_file << "  \"uncompressed_bytes\": " << uncompressed_bytes << ",\n";
+	json_file << "  \"compressed_bytes\": " << compressed_bytes << ",\n";
+	json_file << "  \"images_per_s\": " << static_cast<double>(results.size()) / wall_time_s << ",\n";
+	json_file << "  \"mb_per_s\": " << uncompressed_mb / wall_time_s << ",\n";
+
+	// mb_per_s of a stage is for a single thread: uncompressed megabytes over the total time spent in the stage
+	json_file << "  \"stages\": {\n";
+	for (size_t s = 0; s < std::size(STAGES); s++)
+	{
+		std::vector<double> times;
+		for (const auto& result : results)
+		{
+			times.push_back(result.*STAGES[s].time);
+		}
+		std::sort(times.begin(), times.end());
+
+		double total_ms = 0.0;
+		for (double time : times)
+		{
+			total_ms += time;
+		}
+
+		json_file << "    " << json_string(STAGES[s].name) << ": {"
+		          << "\"total_ms\": " << total_ms
+		          << ", \"mb_per_s\": " << (total_ms > 0.0 ? uncompressed_mb / (total_ms / 1000.0) : 0.0)
+		          << ", \"p50_ms\": " << percentile(times, 50.0)
+		          << ", \"p90_ms\": " << percentile(times, 90.0)
+		          << ", \"p99_ms\": " << percentile(times, 99.0)
+		          << ", \"max_ms\": " << (times.empty() ? 0.0 : times.back());
+
+		if (with_counters)
+		{
+			sqh::trace::CounterValues counters;
+			uint64_t blocks = 0;
+			for (const auto& result : results)
+			{
+				counters += result.*STAGES[s].counters;
+				blocks += result.blocks;
+			}
+
+			auto per_block = [blocks](uint64_t count) {
+				return blocks == 0 ? 0.0 : static_cast<double>(count) / static_cast<double>(blocks);
+			};
+
+			json_file << ", \"cycles\": " << counters.cycles
+			          << ", \"instructions\": " << counters.instructions
+			          << ", \"ipc\": " << counters.ipc()
+			          << ", \"cache_misses\": " << counters.cacheMisses
+			          << ", \"branch_misses\": " << counters.branchMisses
+			          << ", \"cache_misses_per_block\": " << per_block(counters.cacheMisses)
+			          << ", \"branch_misses_per_block\": " << per_block(counters.branchMisses);
+		}
+
+		json_file << "}" << (s + 1 < std::size(STAGES) ? "," : "") << "\n";
+	}
+	json_file << "  },\n";
+
+	json_file << "  \"files\": [\n";
+	for (size_t k = 0; k < results.size(); k++)
+	{
+		const auto& result = results[k];
+
+		json_file << "    {\"name\": " << json_string(result.path.filename().string())
+		          << ", \"success\": " << (result.success ? "true" : "false")
+		          << ", \"compressed_bytes\": " << result.compressed_size
+		          << ", \"uncompressed_bytes\": " << result.uncompressed_size
+		          << ", \"error\": " << result.average_error
+		          << ", \"dct_blocks\": " << result.encode_stats.dctBlocks
+		          << ", \"haar_blocks\": " << result.encode_stats.haarBlocks
+		          << ", \"short_blocks\": " << result.encode_stats.shortBlocks
+		          << ", \"long_blocks\": " << result.encode_stats.longBlocks
+		          << ", \"average_quality\": " << result.encode_stats.averageQuality;
+		if (result.estimate.sampledBlocks > 0)
+		{
+			json_file << ", \"estimated_bytes\": " << result.estimate.bytes
+			          << ", \"estimate_error_bound\": " << result.estimate.errorBound
+			          << ", \"estimate_ms\": " << result.estimate_ms;
+		}
+		for (const auto& stage : STAGES)
+		{
+			json_file << ", \"" << stage.name << "_ms\": " << result.*stage.time;
+		}
+		json_file << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+	}
+	json_file << "  ]\n";
+	json_file << "}" << std::endl;
+
+	json_file.close();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	argparse::ArgumentParser program("squashtest", "0.1");
+
+	program.add_argument("root")
+		.default_value(std::string("./data/TEXT_DATASET/"))
+		.nargs(argparse::nargs_pattern::optional)
+		.help("the data set folder, containing a data folder with the images and an out folder for the squash files");
+	program.add_argument("-j", "--threads")
+		.default_value(std::max(1u, std::thread::hardware_concurrency()))
+		.scan<'u', unsigned int>()
+		.help("the number of images processed at the same time");
+	program.add_argument("-q", "--quality")
+		.default_value(0.75)
+		.scan<'g', double>()
+		.help("the compression quality");
+	program.add_argument("--optimize")
+		.implicit_value(true)
+		.default_value(false)
+		.help("tune the quantization tables of every image for the quality before compressing it");
+	program.add_argument("--qtables")
+		.metavar("profile file")
+		.help("compress every image with the quantization tables of a profile trained by squashtrain");
+	program.add_argument("--tile-size")
+		.default_value(0u)
+		.scan<'u', unsigned int>()
+		.metavar("pixels")
+		.help("compress every image in tiles of this size (a multiple of 8, 0: no tiles)");
+	program.add_argument("--progressive")
+		.implicit_value(true)
+		.default_value(false)
+		.help("compress every image with its coefficients ordered by frequency band");
+	program.add_argument("--estimate")
+		.metavar("fraction")
+		.scan<'g', double>()
+		.help("also estimate the size of every file from this fraction of its blocks (1: all of them), and check it");
+	program.add_argument("--jpeg-baseline")
+		.implicit_value(true)
+		.default_value(false)
+		.help("compare squash and JPEG at several quality settings instead, see rate_distortion.csv");
+	program.add_argument("--trace")
+		.metavar("trace file")
+		.help("save a Chrome trace of the run (needs a build configured with SQUASH_TRACING)");
+	program.add_argument("--counters")
+		.implicit_value(true)
+		.default_value(false)
+		.help("read hardware counters (cycles, instructions, cache and branch misses) around every stage (Linux only)");
+
+	try {
+		program.parse_args(argc, argv);
+	}
+	catch (const std::runtime_error& err)
+	{
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		std::exit(1);
+	}
+
+	auto root_path = fs::path(program.get<std::string>("root"));
+	auto data_path = root_path / "data";
+	auto sqh_out_path = root_path / "out";
+	auto thread_count = std::max(1u, program.get<unsigned int>("--threads"));
+	sqh::EncoderOptions settings;
+	settings.quality = program.get<double>("--quality");
+	settings.optimizeQTables = program.get<bool>("--optimize");
+	settings.tileSize = program.get<unsigned int>("--tile-size");
+	settings.progressive = program.get<bool>("--progressive");
+
+	double estimate_fraction = program.present<double>("--estimate").value_or(0.0);
+
+	std::optional<sqh::QTableProfile> profile;
+	if (auto profile_path = program.present("--qtables"))
+	{
+		profile.emplace();
+		if (!profile->open(*profile_path))
+			return 1;
+	}
+
+	std::vector<fs::path> files;
+	for (const auto& entry : fs::directory_iterator(data_path))
+	{
+		files.push_back(entry.path());
+	}
+	std::sort(files.begin(), files.end());
+
+	if (program.get<bool>("--jpeg-baseline"))
+	{
+		sqh::test::run_jpeg_baseline(root_path, files, thread_count);
+		return 0;
+	}
+
+	fs::create_directories(sqh_out_path);
+
+	// results keep the order of files
+	std::vector<FileResult> results(files.size());
+
+	auto start = Clock::now();
+
+	bool with_counters = program.get<bool>("--counters");
+	if (with_counters && !sqh::trace::PerfCounters().available())
+	{
+		std::cout << "[ERROR] (squashtest): Hardware counters are not available, they will not be reported" << std::endl;
+		with_counters = false;
+	}
+
+	sqh::for_each_parallel(files.size(), thread_count, [&](size_t k) {
+		// counters only count the thread that opened them and the threads it starts, so each image gets its own
+		std::optional<sqh::trace::PerfCounters> counters;
+		if (with_counters)
+			counters.emplace();
+
+		results[k] = process_file(files[k], sqh_out_path, settings, profile ? &*profile : nullptr, estimate_fraction,
+		                          counters ? &*counters : nullptr);
+	});
+
+	double wall_time_ms = elapsed_ms(start);
+
+	for (const auto& result : results)
+	{
+		if (result.success)
+			std::cout << result.average_error << std::endl;
+		else
+			std::cout << "[ERROR] (squashtest): Failed to process " << result.path << std::endl;
+	}
+
+	write_stats(root_path, results);
+	write_json(root_path, results, thread_count, settings.quality, wall_time_ms, with_counters);
+
+	if (auto trace_path = program.present("--trace"))
+	{
+		if (sqh::trace::ENABLED)
+			sqh::trace::saveChromeTrace(*trace_path);
+		else
+			std::cout << "[ERROR] (squashtest): squashlib was built without SQUASH_TRACING, no trace saved" << std::endl;
+	}
+
+	if (estimate_fraction > 0.0)
+		print_estimates(results, estimate_fraction);
+
+	std::cout << results.size() << " images in " << wall_time_ms / 1000.0 << " s on " << thread_count << " threads"
+	          << std::endl;
 
 	return 0;
 }
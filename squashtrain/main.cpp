@@ -0,0 +1,101 @@
+/**
+ * @file main.cpp
+ * @author Eliot Fondere
+ * @brief Trains quantization tables on a directory of images and saves them as a profile for the encoder
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "argparse/argparse.hpp"
+#include <squashlib/squash.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+void print_table(const char* name, const sqh::math::Matrix<sqh::BLOCK_SIZE, sqh::BLOCK_SIZE, float>& table)
+{
+	std::cout << name << ":" << std::endl;
+	for (size_t i = 0; i < sqh::BLOCK_SIZE; i++)
+	{
+		for (size_t j = 0; j < sqh::BLOCK_SIZE; j++)
+		{
+			std::cout << std::setw(5) << table.data[i][j];
+		}
+		std::cout << std::endl;
+	}
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	argparse::ArgumentParser program("squashtrain", "0.1");
+
+	program.add_argument("images")
+		.required()
+		.help("directory of the training images (PNG)");
+	program.add_argument("-o", "--output")
+		.required()
+		.metavar("profile file")
+		.help("where to save the trained tables, to be used with --qtables when compressing");
+	program.add_argument("-q", "--quality")
+		.default_value(0.8)
+		.scan<'g', double>()
+		.help("the compression quality to train the tables for");
+	program.add_argument("-j", "--threads")
+		.default_value(std::max(1u, std::thread::hardware_concurrency()))
+		.scan<'u', unsigned int>()
+		.help("number of threads loading and sampling the images");
+
+	try {
+		program.parse_args(argc, argv);
+	}
+	catch (const std::runtime_error& err)
+	{
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		std::exit(1);
+	}
+
+	std::vector<std::string> image_paths;
+	for (const auto& entry : fs::directory_iterator(program.get("images")))
+	{
+		auto extension = entry.path().extension();
+		if (entry.is_regular_file() && (extension == ".png" || extension == ".PNG"))
+			image_paths.push_back(entry.path().string());
+	}
+	std::sort(image_paths.begin(), image_paths.end());
+
+	sqh::EncoderOptions options;
+	options.quality = program.get<double>("--quality");
+	options.threads = program.get<unsigned int>("--threads");
+
+	auto start = std::chrono::steady_clock::now();
+
+	sqh::QTableProfile profile;
+	if (!sqh::SquashImage::trainQTables(image_paths, options, profile))
+		return 1;
+
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!profile.save(program.get("--output")))
+		return 1;
+
+	std::cout << "Trained on " << profile.images << " of " << image_paths.size() << " images in " << elapsed
+	          << " s for quality " << profile.quality << std::endl;
+	print_table("DCT table", profile.dctTable);
+	print_table("Haar table", profile.haarTable);
+
+	return 0;
+}
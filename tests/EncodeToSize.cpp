@@ -0,0 +1,116 @@
+/**
+ * @file EncodeToSize.cpp
+ * @author Eliot Fondere
+ * @brief Checks that a generous byte budget never encodes worse than the default tables
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include <squashlib/squash.hpp>
+
+#include <stb/stb_image_write.h>
+
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace sqh;
+
+namespace
+{
+
+constexpr int WIDTH = 320;
+constexpr int HEIGHT = 240;
+
+// hard edges and noise: the coefficients of such blocks overflow int8_t with tables finer than the default ones
+std::vector<uint8_t> make_image()
+{
+	std::vector<uint8_t> pixels(3 * WIDTH * HEIGHT);
+	std::mt19937 rng(7);
+
+	for (int y = 0; y < HEIGHT; y++)
+	{
+		for (int x = 0; x < WIDTH; x++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				int value = ((x / 3 + y / 5 + c) % 2) ? 250 : 5;
+				if (x > WIDTH / 2)
+					value = static_cast<int>(rng() % 256);
+				pixels[3 * (y * WIDTH + x) + c] = static_cast<uint8_t>(value);
+			}
+		}
+	}
+
+	return pixels;
+}
+
+double psnr(const uint8_t* original, const uint8_t* decoded)
+{
+	double squared_error = 0.0;
+	for (size_t k = 0; k < 3 * static_cast<size_t>(WIDTH) * HEIGHT; k++)
+	{
+		double difference = static_cast<double>(original[k]) - static_cast<double>(decoded[k]);
+		squared_error += difference * difference;
+	}
+
+	double mse = squared_error / (3.0 * WIDTH * HEIGHT);
+	return mse == 0.0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+} // namespace
+
+int main()
+{
+	auto png_path = (std::filesystem::temp_directory_path() / "squash_encode_to_size.png").string();
+	auto pixels = make_image();
+	if (!stbi_write_png(png_path.c_str(), WIDTH, HEIGHT, 3, pixels.data(), 3 * WIDTH))
+	{
+		std::cout << "[FAIL] could not write " << png_path << std::endl;
+		return 1;
+	}
+
+	SquashImage image(png_path);
+	std::filesystem::remove(png_path);
+	if (image.getData() == nullptr)
+	{
+		std::cout << "[FAIL] could not open the test image" << std::endl;
+		return 1;
+	}
+
+	EncoderOptions options;
+	std::vector<uint8_t> default_file;
+	image.encode(default_file, options);
+
+	SquashImage default_image;
+	default_image.decode(default_file);
+	double default_psnr = psnr(pixels.data(), default_image.getData());
+
+	int failures = 0;
+	for (uint64_t budget : {default_file.size(), 2 * default_file.size(), uint64_t(100) << 20})
+	{
+		std::vector<uint8_t> file;
+		float scale = 0.f;
+		if (!image.encodeToSize(file, budget, options, &scale))
+		{
+			std::cout << "[FAIL] encodeToSize(" << budget << ") failed" << std::endl;
+			failures++;
+			continue;
+		}
+
+		SquashImage decoded;
+		decoded.decode(file);
+		double budget_psnr = psnr(pixels.data(), decoded.getData());
+
+		bool ok = file.size() <= budget && budget_psnr >= default_psnr - 0.01;
+		std::cout << (ok ? "[OK] " : "[FAIL] ") << "budget " << budget << ": scale " << scale << ", " << file.size()
+		          << " bytes, " << budget_psnr << " dB (default " << default_psnr << " dB)" << std::endl;
+		failures += ok ? 0 : 1;
+	}
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file LazyDecode.cpp
+ * @author Eliot Fondere
+ * @brief Checks that pixels and rows of lazily opened files match the eager decode, even with a one-group cache
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "TestImage.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace sqh;
+
+int main()
+{
+	int failures = 0;
+	auto file_path = test::temp_path("squash_lazy_decode.sqh");
+
+	for (auto [width, height] : test::IMAGE_SIZES)
+	{
+		auto pixels = test::make_pixels(width, height, width + 3 * height);
+		SquashImage image;
+		if (!test::open_pixels(image, pixels, width, height, "squash_lazy_decode"))
+			return 1;
+
+		for (uint32_t tile_size : {0u, 16u})
+		{
+			std::string name = std::to_string(width) + "x" + std::to_string(height) + ", tiles of " +
+			                   std::to_string(tile_size);
+
+			EncoderOptions options;
+			options.tileSize = tile_size;
+			std::vector<uint8_t> file;
+			SquashImage eager;
+			if (!image.encode(file, options) || !test::write_file(file_path, file) || !eager.decode(file))
+			{
+				failures += test::report(false, name + ": encode");
+				continue;
+			}
+			const uint8_t* reference = eager.getData();
+
+			// a cache of 1 byte still holds one group, the default one holds every group of these images
+			for (size_t cache_bytes : {size_t(1), SquashImage::DEFAULT_CACHE_BYTES})
+			{
+				std::string cache = name + ", " + std::to_string(cache_bytes) + " byte cache";
+
+				SquashImage lazy;
+				if (!lazy.openLazy(file_path, cache_bytes) || lazy.getHeader().size_x != width ||
+				    lazy.getHeader().size_y != height)
+				{
+					failures += test::report(false, cache + ": openLazy");
+					continue;
+				}
+
+				// rows from the bottom up, so that each one evicts the groups of the one before
+				bool rows_match = true;
+				std::vector<uint8_t> row(3 * static_cast<size_t>(width));
+				for (uint32_t y = height; y-- > 0 && rows_match;)
+				{
+					rows_match = lazy.getRow(y, row.data()) &&
+					             std::memcmp(row.data(), reference + 3 * static_cast<size_t>(y) * width, row.size()) == 0;
+				}
+				failures += test::report(rows_match, cache + ": rows");
+
+				// pixels in random order, which jump between groups, and the corners
+				bool pixels_match = true;
+				std::mt19937 rng(width * height);
+				for (int k = 0; k < 2000 && pixels_match; k++)
+				{
+					uint32_t x = k < 2 ? (k == 0 ? 0 : width - 1) : rng() % width;
+					uint32_t y = k < 2 ? (k == 0 ? 0 : height - 1) : rng() % height;
+
+					uint8_t rgb[3] = {};
+					pixels_match = lazy.getPixel(x, y, rgb) &&
+					               std::memcmp(rgb, reference + 3 * (static_cast<size_t>(y) * width + x), 3) == 0;
+				}
+				failures += test::report(pixels_match, cache + ": pixels");
+
+				uint8_t rgb[3];
+				failures += test::report(!lazy.getPixel(width, 0, rgb) && !lazy.getRow(height, row.data()),
+				                         cache + ": out of range");
+			}
+		}
+	}
+
+	std::filesystem::remove(file_path);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file Progressive.cpp
+ * @author Eliot Fondere
+ * @brief Checks that progressive files decode to the sequential image, and that their prefixes decode to previews
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "TestImage.hpp"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+using namespace sqh;
+
+namespace
+{
+
+double squared_error(const uint8_t* first, const uint8_t* second, size_t count)
+{
+	double sum = 0.0;
+	for (size_t k = 0; k < count; k++)
+	{
+		double difference = static_cast<double>(first[k]) - static_cast<double>(second[k]);
+		sum += difference * difference;
+	}
+
+	return sum;
+}
+
+} // namespace
+
+int main()
+{
+	int failures = 0;
+
+	for (auto [width, height] : test::IMAGE_SIZES)
+	{
+		auto pixels = test::make_pixels(width, height, width ^ height);
+		SquashImage image;
+		if (!test::open_pixels(image, pixels, width, height, "squash_progressive"))
+			return 1;
+
+		std::string size = std::to_string(width) + "x" + std::to_string(height);
+		size_t values = 3 * static_cast<size_t>(width) * height;
+
+		std::vector<uint8_t> sequential_file;
+		SquashImage sequential;
+		if (!image.encode(sequential_file, {}) || !sequential.decode(sequential_file))
+		{
+			failures += test::report(false, size + ": sequential encode");
+			continue;
+		}
+
+		EncoderOptions options;
+		options.progressive = true;
+		std::vector<uint8_t> file;
+		if (!image.encode(file, options))
+		{
+			failures += test::report(false, size + ": progressive encode");
+			continue;
+		}
+
+		SquashImage decoded;
+		failures += test::report(decoded.decode(file) && test::same_image(decoded, sequential.getData(), width, height),
+		                         size + ": full decode");
+
+		// every prefix decodes to a preview of the whole image, which gets closer to it as the prefix grows
+		bool prefixes_decode = true;
+		double first_error = INFINITY;
+		double last_error = INFINITY;
+		for (size_t eighths = 1; eighths < 8 && prefixes_decode; eighths++)
+		{
+			std::vector<uint8_t> prefix(file.begin(), file.begin() + static_cast<std::ptrdiff_t>(file.size() * eighths / 8));
+
+			SquashImage preview;
+			prefixes_decode = preview.decode(prefix) && preview.getHeader().size_x == width &&
+			                  preview.getHeader().size_y == height;
+			if (!prefixes_decode)
+				break;
+
+			last_error = squared_error(preview.getData(), sequential.getData(), values);
+			if (eighths == 1)
+				first_error = last_error;
+		}
+		prefixes_decode = prefixes_decode && last_error <= first_error;
+
+		std::vector<uint8_t> almost_all(file.begin(), file.end() - 1);
+		SquashImage almost;
+		prefixes_decode = prefixes_decode && almost.decode(almost_all) && almost.getHeader().size_x == width;
+		failures += test::report(prefixes_decode, size + ": truncated decodes");
+	}
+
+	return failures == 0 ? 0 : 1;
+}
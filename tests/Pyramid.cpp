@@ -0,0 +1,124 @@
+/**
+ * @file Pyramid.cpp
+ * @author Eliot Fondere
+ * @brief Checks the levels of pyramid files: the first one is the plain file, the others halve its size
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "TestImage.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace sqh;
+
+namespace
+{
+
+// the level files of a pyramid, as indexed by its header
+bool split_levels(const std::vector<uint8_t>& file, std::vector<std::vector<uint8_t>>& levels)
+{
+	size_t index_start = sizeof(uint32_t) + sizeof(SquashHeader);
+	if (file.size() < index_start + sizeof(uint32_t))
+		return false;
+
+	uint32_t magic_number = 0;
+	uint32_t level_count = 0;
+	std::memcpy(&magic_number, file.data(), sizeof(uint32_t));
+	std::memcpy(&level_count, file.data() + index_start, sizeof(uint32_t));
+	if (magic_number != PYRAMID_MAGIC_NUMBER || file.size() < index_start + sizeof(uint32_t) * (1 + 2 * level_count))
+		return false;
+
+	std::vector<uint64_t> offsets(level_count + 1, file.size());
+	std::memcpy(offsets.data(), file.data() + index_start + sizeof(uint32_t), level_count * sizeof(uint64_t));
+
+	levels.clear();
+	for (uint32_t level = 0; level < level_count; level++)
+	{
+		if (offsets[level] > offsets[level + 1])
+			return false;
+		levels.emplace_back(file.begin() + static_cast<std::ptrdiff_t>(offsets[level]),
+		                    file.begin() + static_cast<std::ptrdiff_t>(offsets[level + 1]));
+	}
+
+	return true;
+}
+
+} // namespace
+
+int main()
+{
+	int failures = 0;
+
+	for (auto [width, height] : test::IMAGE_SIZES)
+	{
+		auto pixels = test::make_pixels(width, height, width * height);
+		SquashImage image;
+		if (!test::open_pixels(image, pixels, width, height, "squash_pyramid"))
+			return 1;
+
+		std::string size = std::to_string(width) + "x" + std::to_string(height);
+
+		std::vector<uint8_t> plain_file;
+		SquashImage plain;
+		if (!image.encode(plain_file, {}) || !plain.decode(plain_file))
+		{
+			failures += test::report(false, size + ": plain encode");
+			continue;
+		}
+
+		for (unsigned int requested_levels : {2u, 4u, 32u})
+		{
+			std::string name = size + ", " + std::to_string(requested_levels) + " levels";
+
+			EncoderOptions options;
+			options.pyramidLevels = requested_levels;
+			std::vector<uint8_t> file;
+			std::vector<std::vector<uint8_t>> levels;
+			if (!image.encode(file, options) || !split_levels(file, levels))
+			{
+				failures += test::report(false, name + ": encode");
+				continue;
+			}
+
+			// levels halve the size (rounding up) until the image is a single pixel
+			std::vector<SquashHeader> expected_sizes = {image.getHeader()};
+			while (expected_sizes.size() < requested_levels &&
+			       (expected_sizes.back().size_x > 1 || expected_sizes.back().size_y > 1))
+			{
+				auto next = expected_sizes.back();
+				next.size_x = (next.size_x + 1) / 2;
+				next.size_y = (next.size_y + 1) / 2;
+				expected_sizes.push_back(next);
+			}
+
+			failures += test::report(levels.size() == expected_sizes.size() && levels[0] == plain_file,
+			                         name + ": level count and level 0");
+
+			bool sizes_match = levels.size() == expected_sizes.size();
+			for (size_t level = 0; level < levels.size() && sizes_match; level++)
+			{
+				SquashImage decoded;
+				sizes_match = decoded.decode(levels[level]) &&
+				              decoded.getHeader().size_x == expected_sizes[level].size_x &&
+				              decoded.getHeader().size_y == expected_sizes[level].size_y;
+			}
+			failures += test::report(sizes_match, name + ": level sizes");
+
+			// a full scale decode of the pyramid reads level 0, a half scale one level 1
+			SquashImage full;
+			bool full_matches = full.decode(file, 1.f) && test::same_image(full, plain.getData(), width, height);
+
+			SquashImage half;
+			SquashImage level_one;
+			bool half_matches = half.decode(file, 0.5f) && level_one.decode(levels[1]) &&
+			                    test::same_image(half, level_one.getData(), expected_sizes[1].size_x,
+			                                     expected_sizes[1].size_y);
+			failures += test::report(full_matches && half_matches, name + ": decode by scale");
+		}
+	}
+
+	return failures == 0 ? 0 : 1;
+}
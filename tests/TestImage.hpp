@@ -0,0 +1,108 @@
+/**
+ * @file TestImage.hpp
+ * @author Eliot Fondere
+ * @brief Synthetic images and temporary files shared by the tests
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#ifndef INCLUDE_SQH_TEST_IMAGE_HPP
+#define INCLUDE_SQH_TEST_IMAGE_HPP
+
+#include <squashlib/squash.hpp>
+
+#include <stb/stb_image_write.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace sqh::test
+{
+
+// sizes that are not multiples of the block size, or have a single row of blocks, along with a larger one
+struct ImageSize
+{
+	uint32_t width;
+	uint32_t height;
+};
+
+constexpr ImageSize IMAGE_SIZES[] = {{37, 23}, {1000, 3}, {3, 70}, {320, 240}};
+
+// smooth gradients on the left, hard edges in the middle and noise on the right, so that both transforms and both
+// block lengths are used
+inline std::vector<uint8_t> make_pixels(uint32_t width, uint32_t height, uint32_t seed)
+{
+	std::vector<uint8_t> pixels(3 * static_cast<size_t>(width) * height);
+	std::mt19937 rng(seed);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			for (uint32_t c = 0; c < 3; c++)
+			{
+				uint32_t value = (x * 255 / width + y * 2 + 40 * c) % 256;
+				if (3 * x > width)
+					value = ((x / 3 + y / 5 + c) % 2) ? 250 : 5;
+				if (3 * x > 2 * width)
+					value = rng() % 256;
+				pixels[3 * (static_cast<size_t>(y) * width + x) + c] = static_cast<uint8_t>(value);
+			}
+		}
+	}
+
+	return pixels;
+}
+
+inline std::string temp_path(std::string_view name)
+{
+	return (std::filesystem::temp_directory_path() / std::string(name)).string();
+}
+
+// opens the pixels as an image, through a temporary png
+inline bool open_pixels(SquashImage& image, const std::vector<uint8_t>& pixels, uint32_t width, uint32_t height,
+                        std::string_view name)
+{
+	auto png_path = temp_path(std::string(name) + ".png");
+	bool written = stbi_write_png(png_path.c_str(), static_cast<int>(width), static_cast<int>(height), 3, pixels.data(),
+	                              static_cast<int>(3 * width)) != 0;
+
+	bool opened = written && image.open(png_path);
+	std::filesystem::remove(png_path);
+
+	if (!opened)
+		std::cout << "[FAIL] could not open a " << width << "x" << height << " test image" << std::endl;
+	return opened;
+}
+
+inline bool write_file(const std::string& file_path, const std::vector<uint8_t>& data)
+{
+	std::ofstream file(file_path, std::ios::binary);
+	file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+	return static_cast<bool>(file);
+}
+
+// whether image holds a decoded width x height image equal to pixels
+inline bool same_image(SquashImage& image, const uint8_t* pixels, uint32_t width, uint32_t height)
+{
+	const auto& header = image.getHeader();
+	return image.getData() != nullptr && header.size_x == width && header.size_y == height &&
+	       std::memcmp(image.getData(), pixels, 3 * static_cast<size_t>(width) * height) == 0;
+}
+
+inline int report(bool ok, const std::string& check)
+{
+	std::cout << (ok ? "[OK] " : "[FAIL] ") << check << std::endl;
+	return ok ? 0 : 1;
+}
+
+} // namespace sqh::test
+
+#endif // INCLUDE_SQH_TEST_IMAGE_HPP
@@ -0,0 +1,110 @@
+/**
+ * @file TiledDecode.cpp
+ * @author Eliot Fondere
+ * @brief Checks that tiled files, and regions of them, decode to the same pixels as the untiled file
+ *
+ * @copyright Copyright (c) 2023 Eliot Fondere (MIT License)
+ */
+
+#include "TestImage.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace sqh;
+
+namespace
+{
+
+// decodes the region into a buffer wider than it, and compares it with the same pixels of reference
+bool region_matches(SquashImage& tiles, const uint8_t* reference, uint32_t width, uint32_t x, uint32_t y,
+                    uint32_t region_width, uint32_t region_height)
+{
+	size_t stride = 3 * static_cast<size_t>(region_width) + 5;
+	std::vector<uint8_t> region(stride * region_height, 0xCD);
+	if (!tiles.decodeRegion(x, y, region_width, region_height, region.data(), stride))
+		return false;
+
+	for (uint32_t row = 0; row < region_height; row++)
+	{
+		const uint8_t* expected = reference + 3 * (static_cast<size_t>(y + row) * width + x);
+		if (std::memcmp(region.data() + row * stride, expected, 3 * static_cast<size_t>(region_width)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+} // namespace
+
+int main()
+{
+	int failures = 0;
+	auto file_path = test::temp_path("squash_tiled_decode.sqh");
+
+	for (auto [width, height] : test::IMAGE_SIZES)
+	{
+		auto pixels = test::make_pixels(width, height, width + height);
+		SquashImage image;
+		if (!test::open_pixels(image, pixels, width, height, "squash_tiled_decode"))
+			return 1;
+
+		std::string size = std::to_string(width) + "x" + std::to_string(height);
+
+		std::vector<uint8_t> plain_file;
+		SquashImage plain;
+		if (!image.encode(plain_file, {}) || !plain.decode(plain_file))
+		{
+			failures += test::report(false, size + ": plain encode");
+			continue;
+		}
+		const uint8_t* reference = plain.getData();
+
+		for (uint32_t tile_size : {0u, 8u, 16u, 64u})
+		{
+			std::string name = size + ", tiles of " + std::to_string(tile_size);
+
+			EncoderOptions options;
+			options.tileSize = tile_size;
+			std::vector<uint8_t> file;
+			if (!image.encode(file, options) || !test::write_file(file_path, file))
+			{
+				failures += test::report(false, name + ": encode");
+				continue;
+			}
+
+			SquashImage decoded;
+			failures += test::report(decoded.decode(file) && test::same_image(decoded, reference, width, height),
+			                         name + ": full decode");
+
+			SquashImage tiles;
+			if (!tiles.openTiles(file_path))
+			{
+				failures += test::report(false, name + ": openTiles");
+				continue;
+			}
+
+			bool regions_match = region_matches(tiles, reference, width, 0, 0, width, height);
+
+			// regions starting and ending anywhere, including inside a block and on the last row or column
+			std::mt19937 rng(tile_size + width);
+			for (int k = 0; k < 40 && regions_match; k++)
+			{
+				uint32_t x = rng() % width;
+				uint32_t y = rng() % height;
+				uint32_t region_width = 1 + rng() % (width - x);
+				uint32_t region_height = 1 + rng() % (height - y);
+				regions_match = region_matches(tiles, reference, width, x, y, region_width, region_height);
+			}
+
+			regions_match = regions_match && region_matches(tiles, reference, width, width - 1, height - 1, 1, 1);
+			failures += test::report(regions_match, name + ": regions");
+		}
+	}
+
+	std::filesystem::remove(file_path);
+	return failures == 0 ? 0 : 1;
+}